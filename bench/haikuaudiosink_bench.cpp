@@ -0,0 +1,615 @@
+/* Benchmark for the Haiku audio sink plugin for GStreamer
+ * Copyright (C) <2017-2023> Gerasim Troeglazov <3dEyes@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more
+ */
+
+/* Drives haikuaudiosink through real write() and callback pairs and prints
+ * one JSON object per case, so results can be diffed between releases:
+ *
+ *   handoff  every caps format and channel count at a range of latency-time
+ *            values, reporting the sink's playback-stats
+ *   caps     a stream whose rate and format change while playing, checking
+ *            that the player is kept across the caps change
+ *   churn    many concurrent sinks cycling NULL -> PLAYING -> NULL, reporting
+ *            time per transition and semaphores, threads and areas the
+ *            cycles leaked
+ *   soak     several sinks playing for a long time next to CPU, memory
+ *            bandwidth and priority churn load, sampling underruns,
+ *            write-timeouts and drift and failing past the thresholds;
+ *            only run when asked for by name
+ */
+
+#include <gst/gst.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <OS.h>
+
+#define BENCH_RATE              48000
+#define BENCH_SAMPLES_PER_BUFFER 1024
+#define BENCH_MEMCPY_SIZE       (8 * 1024 * 1024)
+
+static const gchar *bench_formats[] = { "S16LE", "S32LE", "F32LE", "S8", "U8" };
+static const gint bench_channels[] = { 1, 2 };
+static const gint64 bench_latencies[] = { 2500, 5000, 10000, 20000, 40000 };
+
+typedef struct {
+	int32 sems;
+	int32 threads;
+	int32 areas;
+} BenchResources;
+
+typedef struct {
+	GstElement *pipeline;
+	gint cycles;
+	bigtime_t toPlaying;
+	bigtime_t toNull;
+	gint failures;
+} BenchChurnSink;
+
+static gchar *bench_suite = NULL;
+static gint bench_seconds = 2;
+static gint bench_sinks = 8;
+static gint bench_cycles = 1000;
+static gchar *bench_output = NULL;
+static gint bench_duration = 600;
+static gint bench_interval = 1000;
+static gint bench_cpu_threads = 2;
+static gint bench_memcpy_threads = 1;
+static gint bench_churn_threads = 1;
+static gint64 bench_max_underruns = 0;
+static gint64 bench_max_write_timeouts = 0;
+static gint64 bench_max_drift = 10000;
+
+static int32 bench_load_quit = 0;
+
+static GOptionEntry bench_options[] = {
+	{ "suite", 0, 0, G_OPTION_ARG_STRING, &bench_suite, "Run only this suite: handoff, caps, churn or soak", "NAME" },
+	{ "seconds", 's', 0, G_OPTION_ARG_INT, &bench_seconds, "Seconds of audio per handoff case", "N" },
+	{ "sinks", 0, 0, G_OPTION_ARG_INT, &bench_sinks, "Concurrent sinks in the churn suite", "N" },
+	{ "cycles", 0, 0, G_OPTION_ARG_INT, &bench_cycles, "State change cycles per sink in the churn suite", "N" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &bench_output, "Write the report to FILE instead of stdout", "FILE" },
+	{ "duration", 0, 0, G_OPTION_ARG_INT, &bench_duration, "Seconds the soak suite plays", "N" },
+	{ "interval", 0, 0, G_OPTION_ARG_INT, &bench_interval, "Milliseconds between soak samples", "MS" },
+	{ "cpu-threads", 0, 0, G_OPTION_ARG_INT, &bench_cpu_threads, "Busy-looping threads during the soak", "N" },
+	{ "memcpy-threads", 0, 0, G_OPTION_ARG_INT, &bench_memcpy_threads, "Memory bandwidth threads during the soak", "N" },
+	{ "churn-threads", 0, 0, G_OPTION_ARG_INT, &bench_churn_threads, "Threads changing load thread priorities during the soak", "N" },
+	{ "max-underruns", 0, 0, G_OPTION_ARG_INT64, &bench_max_underruns, "Soak fails above this many underruns per sink", "N" },
+	{ "max-write-timeouts", 0, 0, G_OPTION_ARG_INT64, &bench_max_write_timeouts, "Soak fails above this many write timeouts per sink", "N" },
+	{ "max-drift", 0, 0, G_OPTION_ARG_INT64, &bench_max_drift, "Soak fails above this drift in microseconds per sink", "USEC" },
+	{ NULL }
+};
+
+static gboolean
+bench_json_field (GQuark field, const GValue * value, gpointer data)
+{
+	FILE *file = (FILE*)data;
+	const gchar *name = g_quark_to_string (field);
+
+	if (G_VALUE_HOLDS_UINT64 (value))
+		fprintf (file, ",\"%s\":%" G_GUINT64_FORMAT, name, g_value_get_uint64 (value));
+	else if (G_VALUE_HOLDS_INT64 (value))
+		fprintf (file, ",\"%s\":%" G_GINT64_FORMAT, name, g_value_get_int64 (value));
+	else if (G_VALUE_HOLDS_DOUBLE (value))
+		fprintf (file, ",\"%s\":%.3f", name, g_value_get_double (value));
+
+	return TRUE;
+}
+
+/* Runs the pipeline to EOS and returns the sink's playback-stats. */
+static GstStructure *
+bench_run (const gchar *description, GstClockTime timeout, gchar **error_message)
+{
+	GError *error = NULL;
+	GstElement *pipeline = gst_parse_launch (description, &error);
+	if (pipeline == NULL) {
+		*error_message = g_strdup (error->message);
+		g_error_free (error);
+		return NULL;
+	}
+
+	GstStructure *stats = NULL;
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+	GstBus *bus = gst_element_get_bus (pipeline);
+	GstMessage *message = gst_bus_timed_pop_filtered (bus, timeout,
+		(GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+
+	if (message == NULL) {
+		*error_message = g_strdup ("timeout");
+	} else if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+		gst_message_parse_error (message, &error, NULL);
+		*error_message = g_strdup (error->message);
+		g_error_free (error);
+	} else {
+		GstElement *sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+		g_object_get (sink, "playback-stats", &stats, NULL);
+		gst_object_unref (sink);
+	}
+
+	if (message != NULL)
+		gst_message_unref (message);
+	gst_object_unref (bus);
+
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (pipeline);
+
+	return stats;
+}
+
+static gboolean
+bench_handoff (FILE *file)
+{
+	gboolean result = TRUE;
+	gint buffers = bench_seconds * BENCH_RATE / BENCH_SAMPLES_PER_BUFFER;
+
+	for (guint f = 0; f < G_N_ELEMENTS (bench_formats); f++) {
+		for (guint c = 0; c < G_N_ELEMENTS (bench_channels); c++) {
+			for (guint l = 0; l < G_N_ELEMENTS (bench_latencies); l++) {
+				gint64 latency = bench_latencies[l];
+				gchar *description = g_strdup_printf ("audiotestsrc num-buffers=%d samplesperbuffer=%d ! "
+					"audio/x-raw,format=%s,channels=%d,rate=%d,layout=interleaved ! "
+					"haikuaudiosink name=sink latency-time=%" G_GINT64_FORMAT " buffer-time=%" G_GINT64_FORMAT,
+					buffers, BENCH_SAMPLES_PER_BUFFER, bench_formats[f], bench_channels[c], BENCH_RATE,
+					latency, latency * 20);
+
+				gchar *error = NULL;
+				GstStructure *stats = bench_run (description,
+					(bench_seconds + 10) * GST_SECOND, &error);
+
+				fprintf (file, "{\"suite\":\"handoff\",\"format\":\"%s\",\"channels\":%d,\"latency-time\":%" G_GINT64_FORMAT,
+					bench_formats[f], bench_channels[c], latency);
+				if (stats != NULL) {
+					gst_structure_foreach (stats, bench_json_field, file);
+					fprintf (file, ",\"ok\":true}\n");
+					gst_structure_free (stats);
+				} else {
+					gchar *escaped = g_strescape (error, NULL);
+					fprintf (file, ",\"ok\":false,\"error\":\"%s\"}\n", escaped);
+					g_free (escaped);
+					result = FALSE;
+				}
+				fflush (file);
+
+				g_free (error);
+				g_free (description);
+			}
+		}
+	}
+
+	return result;
+}
+
+/* Waits on the pipeline's bus for an error, returns its message or NULL. */
+static gchar *
+bench_wait_error (GstElement *pipeline, GstClockTime timeout)
+{
+	gchar *error_message = NULL;
+	GstBus *bus = gst_element_get_bus (pipeline);
+	GstMessage *message = gst_bus_timed_pop_filtered (bus, timeout,
+		(GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+
+	if (message != NULL) {
+		if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+			GError *error = NULL;
+			gst_message_parse_error (message, &error, NULL);
+			error_message = g_strdup (error->message);
+			g_error_free (error);
+		} else {
+			error_message = g_strdup ("unexpected EOS");
+		}
+		gst_message_unref (message);
+	}
+	gst_object_unref (bus);
+
+	return error_message;
+}
+
+/* Plays, renegotiates to another rate and format through the capsfilter
+ * and plays on; the sink should keep its player and convert. */
+static gboolean
+bench_caps (FILE *file)
+{
+	GError *parse_error = NULL;
+	gchar *error = NULL;
+	guint64 creations = 0, underruns = 0, timeouts = 0;
+
+	GstElement *pipeline = gst_parse_launch ("audiotestsrc ! "
+		"capsfilter name=caps caps=audio/x-raw,format=S16LE,channels=2,rate=48000 ! "
+		"haikuaudiosink name=sink", &parse_error);
+	if (pipeline == NULL) {
+		error = g_strdup (parse_error->message);
+		g_error_free (parse_error);
+	} else {
+		gst_element_set_state (pipeline, GST_STATE_PLAYING);
+		error = bench_wait_error (pipeline, bench_seconds * GST_SECOND);
+
+		if (error == NULL) {
+			GstElement *caps = gst_bin_get_by_name (GST_BIN (pipeline), "caps");
+			GstCaps *changed = gst_caps_from_string ("audio/x-raw,format=F32LE,channels=2,rate=44100");
+			g_object_set (caps, "caps", changed, NULL);
+			gst_caps_unref (changed);
+			gst_object_unref (caps);
+
+			error = bench_wait_error (pipeline, bench_seconds * GST_SECOND);
+		}
+
+		if (error == NULL) {
+			GstStructure *stats = NULL;
+			GstElement *sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+			g_object_get (sink, "playback-stats", &stats, NULL);
+			gst_structure_get_uint64 (stats, "player-creations", &creations);
+			gst_structure_get_uint64 (stats, "underruns", &underruns);
+			gst_structure_get_uint64 (stats, "write-timeouts", &timeouts);
+			gst_structure_free (stats);
+			gst_object_unref (sink);
+		}
+
+		gst_element_set_state (pipeline, GST_STATE_NULL);
+		gst_object_unref (pipeline);
+	}
+
+	gboolean result = error == NULL && creations == 1;
+
+	fprintf (file, "{\"suite\":\"caps\"");
+	if (error == NULL) {
+		fprintf (file, ",\"player-creations\":%" G_GUINT64_FORMAT ",\"underruns\":%" G_GUINT64_FORMAT
+			",\"write-timeouts\":%" G_GUINT64_FORMAT ",\"ok\":%s}\n",
+			creations, underruns, timeouts, result ? "true" : "false");
+	} else {
+		gchar *escaped = g_strescape (error, NULL);
+		fprintf (file, ",\"ok\":false,\"error\":\"%s\"}\n", escaped);
+		g_free (escaped);
+	}
+	fflush (file);
+	g_free (error);
+
+	return result;
+}
+
+/* Counts what this team holds once pooled streaming threads are gone. */
+static void
+bench_resources (BenchResources *resources)
+{
+	g_thread_pool_stop_unused_threads ();
+	snooze (G_USEC_PER_SEC / 10);
+
+	team_info info;
+	get_team_info (B_CURRENT_TEAM, &info);
+	resources->threads = info.thread_count;
+	resources->areas = info.area_count;
+
+	sem_info sem;
+	int32 cookie = 0;
+	resources->sems = 0;
+	while (get_next_sem_info (B_CURRENT_TEAM, &cookie, &sem) == B_OK)
+		resources->sems++;
+}
+
+static gboolean
+bench_churn_cycle (BenchChurnSink *churn)
+{
+	gboolean result = TRUE;
+
+	bigtime_t start = system_time();
+	if (gst_element_set_state (churn->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE ||
+		gst_element_get_state (churn->pipeline, NULL, NULL, 5 * GST_SECOND) != GST_STATE_CHANGE_SUCCESS)
+		result = FALSE;
+	bigtime_t playing = system_time();
+	if (gst_element_set_state (churn->pipeline, GST_STATE_NULL) == GST_STATE_CHANGE_FAILURE)
+		result = FALSE;
+	bigtime_t stopped = system_time();
+
+	churn->toPlaying += playing - start;
+	churn->toNull += stopped - playing;
+	if (!result)
+		churn->failures++;
+
+	return result;
+}
+
+static gpointer
+bench_churn_thread (gpointer data)
+{
+	BenchChurnSink *churn = (BenchChurnSink*)data;
+
+	for (gint i = 0; i < churn->cycles; i++)
+		bench_churn_cycle (churn);
+
+	return NULL;
+}
+
+static gboolean
+bench_churn (FILE *file)
+{
+	BenchChurnSink *churn = g_new0 (BenchChurnSink, bench_sinks);
+	GThread **threads = g_new0 (GThread*, bench_sinks);
+	BenchResources before = { 0, 0, 0 }, after = { 0, 0, 0 };
+	gchar *error = NULL;
+
+	g_thread_pool_set_max_unused_threads (0);
+
+	for (gint i = 0; i < bench_sinks && error == NULL; i++) {
+		GError *parse_error = NULL;
+		churn[i].pipeline = gst_parse_launch ("audiotestsrc samplesperbuffer=480 ! haikuaudiosink", &parse_error);
+		churn[i].cycles = bench_cycles;
+		if (churn[i].pipeline == NULL) {
+			error = g_strdup (parse_error->message);
+			g_error_free (parse_error);
+		}
+	}
+
+	bigtime_t toPlaying = 0, toNull = 0;
+	gint failures = 0;
+
+	if (error == NULL) {
+		/* one cycle first, so resources that are meant to live as long as
+		 * the sink (monitor thread, semaphores, recorder) are in the baseline */
+		for (gint i = 0; i < bench_sinks; i++)
+			bench_churn_cycle (&churn[i]);
+		bench_resources (&before);
+
+		for (gint i = 0; i < bench_sinks; i++) {
+			churn[i].toPlaying = churn[i].toNull = 0;
+			churn[i].failures = 0;
+			threads[i] = g_thread_new ("churn", bench_churn_thread, &churn[i]);
+		}
+		for (gint i = 0; i < bench_sinks; i++) {
+			g_thread_join (threads[i]);
+			toPlaying += churn[i].toPlaying;
+			toNull += churn[i].toNull;
+			failures += churn[i].failures;
+		}
+
+		bench_resources (&after);
+	}
+
+	gboolean result = error == NULL && failures == 0 && after.sems <= before.sems &&
+		after.threads <= before.threads && after.areas <= before.areas;
+
+	gint64 transitions = (gint64)bench_sinks * bench_cycles;
+	fprintf (file, "{\"suite\":\"churn\",\"sinks\":%d,\"cycles\":%d", bench_sinks, bench_cycles);
+	if (error == NULL) {
+		fprintf (file, ",\"to-playing-usec\":%.1f,\"to-null-usec\":%.1f,\"failures\":%d"
+			",\"leaked-sems\":%d,\"leaked-threads\":%d,\"leaked-areas\":%d,\"ok\":%s}\n",
+			transitions > 0 ? (double)toPlaying / transitions : 0.0,
+			transitions > 0 ? (double)toNull / transitions : 0.0,
+			failures, after.sems - before.sems, after.threads - before.threads, after.areas - before.areas,
+			result ? "true" : "false");
+	} else {
+		gchar *escaped = g_strescape (error, NULL);
+		fprintf (file, ",\"ok\":false,\"error\":\"%s\"}\n", escaped);
+		g_free (escaped);
+	}
+	fflush (file);
+
+	for (gint i = 0; i < bench_sinks; i++) {
+		if (churn[i].pipeline != NULL)
+			gst_object_unref (churn[i].pipeline);
+	}
+	g_free (threads);
+	g_free (churn);
+	g_free (error);
+
+	return result;
+}
+
+static int32
+bench_cpu_load (void *data)
+{
+	volatile uint64 counter = 0;
+	while (atomic_get(&bench_load_quit) == 0) {
+		for (int i = 0; i < 100000; i++)
+			counter++;
+	}
+	return 0;
+}
+
+static int32
+bench_memcpy_load (void *data)
+{
+	guint8 *source = (guint8*)g_malloc0 (BENCH_MEMCPY_SIZE);
+	guint8 *target = (guint8*)g_malloc (BENCH_MEMCPY_SIZE);
+	while (atomic_get(&bench_load_quit) == 0) {
+		memcpy (target, source, BENCH_MEMCPY_SIZE);
+		memcpy (source, target, BENCH_MEMCPY_SIZE);
+	}
+	g_free (source);
+	g_free (target);
+	return 0;
+}
+
+/* Moves the CPU load threads between priorities, up to just below the
+ * real-time range the player threads run in. */
+static int32
+bench_churn_load (void *data)
+{
+	GArray *threads = (GArray*)data;
+	static const int32 priorities[] = { B_LOW_PRIORITY, B_NORMAL_PRIORITY,
+		B_DISPLAY_PRIORITY, B_URGENT_DISPLAY_PRIORITY };
+	guint32 step = 0;
+
+	while (atomic_get(&bench_load_quit) == 0) {
+		for (guint i = 0; i < threads->len; i++, step++)
+			set_thread_priority (g_array_index (threads, thread_id, i),
+				priorities[step % G_N_ELEMENTS (priorities)]);
+		snooze (G_USEC_PER_SEC / 1000);
+	}
+	return 0;
+}
+
+static void
+bench_load_spawn (GArray *threads, thread_func function, const char *name, gint count, void *data)
+{
+	for (gint i = 0; i < count; i++) {
+		thread_id thread = spawn_thread (function, name, B_NORMAL_PRIORITY, data);
+		if (thread < B_OK)
+			continue;
+		resume_thread (thread);
+		g_array_append_val (threads, thread);
+	}
+}
+
+static gboolean
+bench_soak (FILE *file)
+{
+	GstElement **pipelines = g_new0 (GstElement*, bench_sinks);
+	gint64 *underruns = g_new0 (gint64, bench_sinks);
+	gint64 *timeouts = g_new0 (gint64, bench_sinks);
+	gint64 *drift = g_new0 (gint64, bench_sinks);
+	gchar *error = NULL;
+
+	for (gint i = 0; i < bench_sinks && error == NULL; i++) {
+		GError *parse_error = NULL;
+		pipelines[i] = gst_parse_launch ("audiotestsrc ! haikuaudiosink name=sink", &parse_error);
+		if (pipelines[i] == NULL) {
+			error = g_strdup (parse_error->message);
+			g_error_free (parse_error);
+		}
+	}
+
+	GArray *cpuThreads = g_array_new (FALSE, FALSE, sizeof (thread_id));
+	GArray *otherThreads = g_array_new (FALSE, FALSE, sizeof (thread_id));
+	atomic_set(&bench_load_quit, 0);
+
+	if (error == NULL) {
+		for (gint i = 0; i < bench_sinks; i++)
+			gst_element_set_state (pipelines[i], GST_STATE_PLAYING);
+
+		bench_load_spawn (cpuThreads, bench_cpu_load, "soak cpu", bench_cpu_threads, NULL);
+		bench_load_spawn (otherThreads, bench_memcpy_load, "soak memcpy", bench_memcpy_threads, NULL);
+		bench_load_spawn (otherThreads, bench_churn_load, "soak churn", bench_churn_threads, cpuThreads);
+
+		bigtime_t start = system_time();
+		bigtime_t end = start + (bigtime_t)bench_duration * G_USEC_PER_SEC;
+		while (error == NULL && system_time() < end) {
+			snooze_until (MIN(system_time() + (bigtime_t)bench_interval * 1000, end), B_SYSTEM_TIMEBASE);
+
+			for (gint i = 0; i < bench_sinks && error == NULL; i++) {
+				error = bench_wait_error (pipelines[i], 0);
+				if (error != NULL)
+					break;
+
+				GstStructure *stats = NULL;
+				guint64 value = 0;
+				GstElement *sink = gst_bin_get_by_name (GST_BIN (pipelines[i]), "sink");
+				g_object_get (sink, "playback-stats", &stats, NULL);
+				gst_object_unref (sink);
+
+				gst_structure_get_uint64 (stats, "underruns", &value);
+				underruns[i] = value;
+				gst_structure_get_uint64 (stats, "write-timeouts", &value);
+				timeouts[i] = value;
+				gst_structure_get_int64 (stats, "drift", &drift[i]);
+				gst_structure_free (stats);
+
+				fprintf (file, "{\"suite\":\"soak\",\"time\":%.1f,\"sink\":%d,\"underruns\":%" G_GINT64_FORMAT
+					",\"write-timeouts\":%" G_GINT64_FORMAT ",\"drift\":%" G_GINT64_FORMAT "}\n",
+					(system_time() - start) / (double)G_USEC_PER_SEC, i, underruns[i], timeouts[i], drift[i]);
+			}
+			fflush (file);
+		}
+	}
+
+	atomic_set(&bench_load_quit, 1);
+	GArray *all[] = { otherThreads, cpuThreads };
+	for (guint a = 0; a < G_N_ELEMENTS (all); a++) {
+		for (guint i = 0; i < all[a]->len; i++) {
+			status_t status;
+			wait_for_thread (g_array_index (all[a], thread_id, i), &status);
+		}
+		g_array_free (all[a], TRUE);
+	}
+
+	gint64 maxUnderruns = 0, maxTimeouts = 0, maxDrift = 0;
+	for (gint i = 0; i < bench_sinks; i++) {
+		maxUnderruns = MAX(maxUnderruns, underruns[i]);
+		maxTimeouts = MAX(maxTimeouts, timeouts[i]);
+		maxDrift = MAX(maxDrift, ABS(drift[i]));
+		if (pipelines[i] != NULL) {
+			gst_element_set_state (pipelines[i], GST_STATE_NULL);
+			gst_object_unref (pipelines[i]);
+		}
+	}
+
+	gboolean result = error == NULL && maxUnderruns <= bench_max_underruns &&
+		maxTimeouts <= bench_max_write_timeouts && maxDrift <= bench_max_drift;
+
+	fprintf (file, "{\"suite\":\"soak\",\"sinks\":%d,\"duration\":%d,\"cpu-threads\":%d"
+		",\"memcpy-threads\":%d,\"churn-threads\":%d", bench_sinks, bench_duration,
+		bench_cpu_threads, bench_memcpy_threads, bench_churn_threads);
+	if (error == NULL) {
+		fprintf (file, ",\"max-underruns\":%" G_GINT64_FORMAT ",\"max-write-timeouts\":%" G_GINT64_FORMAT
+			",\"max-drift\":%" G_GINT64_FORMAT ",\"ok\":%s}\n",
+			maxUnderruns, maxTimeouts, maxDrift, result ? "true" : "false");
+	} else {
+		gchar *escaped = g_strescape (error, NULL);
+		fprintf (file, ",\"ok\":false,\"error\":\"%s\"}\n", escaped);
+		g_free (escaped);
+	}
+	fflush (file);
+
+	g_free (pipelines);
+	g_free (underruns);
+	g_free (timeouts);
+	g_free (drift);
+	g_free (error);
+
+	return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new ("- haikuaudiosink benchmark");
+	g_option_context_add_main_entries (context, bench_options, NULL);
+	g_option_context_add_group (context, gst_init_get_option_group ());
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "%s\n", error->message);
+		g_error_free (error);
+		return 2;
+	}
+	g_option_context_free (context);
+
+#ifdef HAIKUAUDIOSINK_PLUGIN
+	/* benchmark the plugin that was just built, not an installed one */
+	GstPlugin *plugin = gst_plugin_load_file (HAIKUAUDIOSINK_PLUGIN, &error);
+	if (plugin == NULL) {
+		fprintf (stderr, "%s\n", error->message);
+		g_error_free (error);
+		return 2;
+	}
+	gst_object_unref (plugin);
+#endif
+
+	FILE *file = stdout;
+	if (bench_output != NULL && (file = fopen (bench_output, "w")) == NULL) {
+		perror (bench_output);
+		return 2;
+	}
+
+	gboolean result = TRUE;
+	if (bench_suite == NULL || strcmp (bench_suite, "handoff") == 0)
+		result &= bench_handoff (file);
+	if (bench_suite == NULL || strcmp (bench_suite, "caps") == 0)
+		result &= bench_caps (file);
+	if (bench_suite == NULL || strcmp (bench_suite, "churn") == 0)
+		result &= bench_churn (file);
+	if (bench_suite != NULL && strcmp (bench_suite, "soak") == 0)
+		result &= bench_soak (file);
+
+	if (file != stdout)
+		fclose (file);
+
+	return result ? 0 : 1;
+}
@@ -0,0 +1,466 @@
+/* Haiku audio device provider for GStreamer
+ * Copyright (C) <2017-2023> Gerasim Troeglazov <3dEyes@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more 
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "haikuaudiodeviceprovider_1.0.h"
+#include <string.h>
+
+#include <Messenger.h>
+
+#define MAX_OUTPUTS 32
+#define MAX_INPUTS  8
+
+typedef struct {
+	gchar *name;
+	media_node node;
+	GstCaps *caps;
+	gboolean isDefault;
+} HaikuAudioOutput;
+
+static GstDevice *gst_haikuaudio_device_new (HaikuAudioOutput *output);
+static gboolean gst_haikuaudio_outputs_affected (BMessage *message);
+static void gst_haikuaudio_device_provider_refresh (void);
+
+/* The output list is shared by every provider and sink in the process.
+ * It is filled on first use and then only rebuilt when the media roster
+ * reports that a node appeared or went away. */
+static GMutex outputs_lock;
+static GList *outputs = NULL;
+static gboolean outputs_valid = FALSE;
+static GList *started_providers = NULL;
+
+class HaikuAudioOutputWatcher : public BLooper {
+public:
+	HaikuAudioOutputWatcher() : BLooper("haikuaudio output watcher") { }
+
+	virtual void MessageReceived(BMessage *message)
+	{
+		switch (message->what) {
+			case B_MEDIA_NODE_CREATED:
+			case B_MEDIA_NODE_DELETED:
+				if (gst_haikuaudio_outputs_affected(message))
+					gst_haikuaudio_device_provider_refresh();
+				break;
+			default:
+				BLooper::MessageReceived(message);
+				break;
+		}
+	}
+};
+
+static HaikuAudioOutputWatcher *outputs_watcher = NULL;
+
+static const gchar *
+gst_format_from_mediakit (uint32 format)
+{
+	switch (format) {
+		case media_raw_audio_format::B_AUDIO_CHAR:
+			return "S8";
+		case media_raw_audio_format::B_AUDIO_UCHAR:
+			return "U8";
+		case media_raw_audio_format::B_AUDIO_SHORT:
+			return "S16LE";
+		case media_raw_audio_format::B_AUDIO_INT:
+			return "S32LE";
+		case media_raw_audio_format::B_AUDIO_FLOAT:
+			return "F32LE";
+		default:
+			return NULL;
+	}
+}
+
+static GstCaps *
+gst_haikuaudio_output_caps (BMediaRoster *roster, const media_node &node)
+{
+	media_input inputs[MAX_INPUTS];
+	int32 count = 0;
+	const media_raw_audio_format *raw = &media_raw_audio_format::wildcard;
+
+	if (roster->GetFreeInputsFor(node, inputs, MAX_INPUTS, &count, B_MEDIA_RAW_AUDIO) == B_OK && count > 0)
+		raw = &inputs[0].format.u.raw_audio;
+
+	GstStructure *structure = gst_structure_new ("audio/x-raw",
+		"layout", G_TYPE_STRING, "interleaved", NULL);
+
+	const gchar *format = gst_format_from_mediakit(raw->format);
+	if (format != NULL) {
+		gst_structure_set (structure, "format", G_TYPE_STRING, format, NULL);
+	} else {
+		GValue list = G_VALUE_INIT;
+		GValue value = G_VALUE_INIT;
+		static const gchar *formats[] = { "S16LE", "S32LE", "F32LE", "S8", "U8" };
+		g_value_init (&list, GST_TYPE_LIST);
+		g_value_init (&value, G_TYPE_STRING);
+		for (guint i = 0; i < G_N_ELEMENTS (formats); i++) {
+			g_value_set_static_string (&value, formats[i]);
+			gst_value_list_append_value (&list, &value);
+		}
+		gst_structure_take_value (structure, "format", &list);
+		g_value_unset (&value);
+	}
+
+	if (raw->channel_count > 0 && raw->channel_count <= 2)
+		gst_structure_set (structure, "channels", G_TYPE_INT, (gint)raw->channel_count, NULL);
+	else
+		gst_structure_set (structure, "channels", GST_TYPE_INT_RANGE, 1, 2, NULL);
+
+	if (raw->frame_rate > 0)
+		gst_structure_set (structure, "rate", G_TYPE_INT, (gint)raw->frame_rate, NULL);
+	else
+		gst_structure_set (structure, "rate", GST_TYPE_INT_RANGE, 1, G_MAXINT, NULL);
+
+	return gst_caps_new_full (structure, NULL);
+}
+
+static void
+gst_haikuaudio_output_free (HaikuAudioOutput *output)
+{
+	g_free (output->name);
+	gst_caps_unref (output->caps);
+	g_free (output);
+}
+
+static GList *
+gst_haikuaudio_enumerate_outputs (void)
+{
+	BMediaRoster *roster = BMediaRoster::Roster();
+	if (roster == NULL)
+		return NULL;
+
+	media_node mixer;
+	bool haveMixer = roster->GetAudioMixer(&mixer) == B_OK;
+
+	media_format format;
+	format.type = B_MEDIA_RAW_AUDIO;
+	format.u.raw_audio = media_raw_audio_format::wildcard;
+
+	live_node_info nodes[MAX_OUTPUTS];
+	int32 count = MAX_OUTPUTS;
+	GList *result = NULL;
+
+	if (roster->GetLiveNodes(nodes, &count, &format, NULL, NULL, B_BUFFER_CONSUMER) == B_OK) {
+		for (int32 i = 0; i < count; i++) {
+			if ((nodes[i].node.kind & (B_SYSTEM_MIXER | B_PHYSICAL_OUTPUT)) == 0)
+				continue;
+
+			HaikuAudioOutput *output = g_new0 (HaikuAudioOutput, 1);
+			output->name = g_strdup (nodes[i].name);
+			output->node = nodes[i].node;
+			output->caps = gst_haikuaudio_output_caps(roster, nodes[i].node);
+			output->isDefault = haveMixer && nodes[i].node.node == mixer.node;
+			result = g_list_append (result, output);
+		}
+	}
+
+	if (haveMixer)
+		roster->ReleaseNode(mixer);
+
+	return result;
+}
+
+/* The caller holds outputs_lock. */
+static void
+gst_haikuaudio_outputs_ensure (void)
+{
+	if (outputs_valid)
+		return;
+
+	if (outputs_watcher == NULL) {
+		BMediaRoster *roster = BMediaRoster::Roster();
+		if (roster != NULL) {
+			outputs_watcher = new HaikuAudioOutputWatcher();
+			outputs_watcher->Run();
+			roster->StartWatching(BMessenger(outputs_watcher), B_MEDIA_NODE_CREATED);
+			roster->StartWatching(BMessenger(outputs_watcher), B_MEDIA_NODE_DELETED);
+		}
+	}
+
+	outputs = gst_haikuaudio_enumerate_outputs();
+	outputs_valid = TRUE;
+}
+
+/* Outputs are keyed by node ID: two cards driven by the same driver
+ * publish nodes with the same name. */
+static HaikuAudioOutput *
+gst_haikuaudio_outputs_find (GList *list, media_node_id id)
+{
+	for (GList *item = list; item != NULL; item = item->next) {
+		HaikuAudioOutput *output = (HaikuAudioOutput*)item->data;
+		if (output->node.node == id)
+			return output;
+	}
+	return NULL;
+}
+
+static HaikuAudioOutput *
+gst_haikuaudio_outputs_match (GList *list, const gchar *device)
+{
+	gchar *end = NULL;
+	gint64 id = g_ascii_strtoll (device, &end, 10);
+	if (end != device && *end == '\0')
+		return gst_haikuaudio_outputs_find(list, (media_node_id)id);
+
+	for (GList *item = list; item != NULL; item = item->next) {
+		HaikuAudioOutput *output = (HaikuAudioOutput*)item->data;
+		if (g_strcmp0 (output->name, device) == 0)
+			return output;
+	}
+	return NULL;
+}
+
+/* Node notifications arrive for every node in the system, including each
+ * sound player. Only a new output or mixer, or the loss of a cached one,
+ * is worth enumerating the roster again. */
+static gboolean
+gst_haikuaudio_outputs_affected (BMessage *message)
+{
+	BMediaRoster *roster = BMediaRoster::CurrentRoster();
+	int32 id;
+
+	for (int32 i = 0; message->FindInt32("media_node_id", i, &id) == B_OK; i++) {
+		gboolean affected = FALSE;
+
+		if (message->what == B_MEDIA_NODE_DELETED) {
+			g_mutex_lock (&outputs_lock);
+			affected = gst_haikuaudio_outputs_find(outputs, id) != NULL;
+			g_mutex_unlock (&outputs_lock);
+		} else {
+			media_node node;
+			if (roster != NULL && roster->GetNodeFor(id, &node) == B_OK) {
+				affected = (node.kind & B_BUFFER_CONSUMER) != 0 &&
+					(node.kind & (B_SYSTEM_MIXER | B_PHYSICAL_OUTPUT)) != 0;
+				roster->ReleaseNode(node);
+			}
+		}
+
+		if (affected)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean
+gst_haikuaudio_device_lookup (const gchar *device, media_node *node)
+{
+	gboolean found = FALSE;
+
+	g_mutex_lock (&outputs_lock);
+	gst_haikuaudio_outputs_ensure();
+	HaikuAudioOutput *output = gst_haikuaudio_outputs_match(outputs, device);
+	if (output != NULL) {
+		*node = output->node;
+		found = TRUE;
+	}
+	g_mutex_unlock (&outputs_lock);
+
+	return found;
+}
+
+static void
+gst_haikuaudio_device_provider_refresh (void)
+{
+	g_mutex_lock (&outputs_lock);
+
+	GList *previous = outputs;
+	outputs = gst_haikuaudio_enumerate_outputs();
+	outputs_valid = TRUE;
+
+	GList *providers = g_list_copy_deep (started_providers, (GCopyFunc) gst_object_ref, NULL);
+	GList *added = NULL;
+	GList *removed = NULL;
+
+	for (GList *item = outputs; item != NULL; item = item->next) {
+		HaikuAudioOutput *output = (HaikuAudioOutput*)item->data;
+		if (gst_haikuaudio_outputs_find(previous, output->node.node) == NULL)
+			added = g_list_append (added, GINT_TO_POINTER (output->node.node));
+	}
+	for (GList *item = previous; item != NULL; item = item->next) {
+		HaikuAudioOutput *output = (HaikuAudioOutput*)item->data;
+		if (gst_haikuaudio_outputs_find(outputs, output->node.node) == NULL)
+			removed = g_list_append (removed, GINT_TO_POINTER (output->node.node));
+	}
+
+	g_list_free_full (previous, (GDestroyNotify) gst_haikuaudio_output_free);
+
+	/* devices are built while the lock is held, announced after */
+	GList *devices = NULL;
+	for (GList *item = added; item != NULL; item = item->next) {
+		HaikuAudioOutput *output = gst_haikuaudio_outputs_find(outputs, GPOINTER_TO_INT (item->data));
+		for (GList *provider = providers; provider != NULL; provider = provider->next)
+			devices = g_list_append (devices, gst_object_ref_sink (gst_haikuaudio_device_new(output)));
+	}
+
+	g_mutex_unlock (&outputs_lock);
+
+	GList *device = devices;
+	for (GList *item = added; item != NULL; item = item->next) {
+		for (GList *provider = providers; provider != NULL; provider = provider->next) {
+			gst_device_provider_device_add (GST_DEVICE_PROVIDER (provider->data), GST_DEVICE (device->data));
+			device = device->next;
+		}
+	}
+
+	for (GList *provider = providers; provider != NULL; provider = provider->next) {
+		GList *current = gst_device_provider_get_devices (GST_DEVICE_PROVIDER (provider->data));
+		for (GList *item = current; item != NULL; item = item->next) {
+			GstHaikuAudioDevice *haikudevice = GST_HAIKUAUDIODEVICE (item->data);
+			if (g_list_find (removed, GINT_TO_POINTER (haikudevice->nodeId)) != NULL)
+				gst_device_provider_device_remove (GST_DEVICE_PROVIDER (provider->data), GST_DEVICE (haikudevice));
+		}
+		g_list_free_full (current, (GDestroyNotify) gst_object_unref);
+	}
+
+	g_list_free_full (devices, (GDestroyNotify) gst_object_unref);
+	g_list_free (added);
+	g_list_free (removed);
+	g_list_free_full (providers, (GDestroyNotify) gst_object_unref);
+}
+
+G_DEFINE_TYPE (GstHaikuAudioDeviceProvider, gst_haikuaudio_device_provider, GST_TYPE_DEVICE_PROVIDER);
+
+/* The caller holds outputs_lock. */
+static GList *
+gst_haikuaudio_outputs_devices (void)
+{
+	GList *devices = NULL;
+
+	gst_haikuaudio_outputs_ensure();
+	for (GList *item = outputs; item != NULL; item = item->next)
+		devices = g_list_append (devices, gst_haikuaudio_device_new((HaikuAudioOutput*)item->data));
+
+	return devices;
+}
+
+static GList *
+gst_haikuaudio_device_provider_probe (GstDeviceProvider * provider)
+{
+	g_mutex_lock (&outputs_lock);
+	GList *devices = gst_haikuaudio_outputs_devices();
+	g_mutex_unlock (&outputs_lock);
+
+	return devices;
+}
+
+static gboolean
+gst_haikuaudio_device_provider_start (GstDeviceProvider * provider)
+{
+	/* registered together with the snapshot: a refresh either happened
+	 * before and is in it, or comes after and sees this provider */
+	g_mutex_lock (&outputs_lock);
+	GList *devices = gst_haikuaudio_outputs_devices();
+	started_providers = g_list_prepend (started_providers, provider);
+	g_mutex_unlock (&outputs_lock);
+
+	for (GList *item = devices; item != NULL; item = item->next)
+		gst_device_provider_device_add (provider, GST_DEVICE (item->data));
+	g_list_free (devices);
+
+	return TRUE;
+}
+
+static void
+gst_haikuaudio_device_provider_stop (GstDeviceProvider * provider)
+{
+	g_mutex_lock (&outputs_lock);
+	started_providers = g_list_remove (started_providers, provider);
+	g_mutex_unlock (&outputs_lock);
+}
+
+static void
+gst_haikuaudio_device_provider_class_init (GstHaikuAudioDeviceProviderClass * klass)
+{
+	GstDeviceProviderClass *dm_class = GST_DEVICE_PROVIDER_CLASS (klass);
+
+	dm_class->probe = gst_haikuaudio_device_provider_probe;
+	dm_class->start = gst_haikuaudio_device_provider_start;
+	dm_class->stop = gst_haikuaudio_device_provider_stop;
+
+	gst_device_provider_class_set_static_metadata (dm_class,
+		"Haiku audio device provider",
+		"Sink/Audio",
+		"List MediaKit audio outputs",
+		"Gerasim Troeglazov <3dEyes@gmail.com>");
+}
+
+static void
+gst_haikuaudio_device_provider_init (GstHaikuAudioDeviceProvider * provider)
+{
+}
+
+G_DEFINE_TYPE (GstHaikuAudioDevice, gst_haikuaudio_device, GST_TYPE_DEVICE);
+
+static GstDevice *
+gst_haikuaudio_device_new (HaikuAudioOutput *output)
+{
+	GstStructure *props = gst_structure_new ("haikuaudio-proplist",
+		"device.api", G_TYPE_STRING, "haiku",
+		"device.node-name", G_TYPE_STRING, output->name,
+		"device.node-id", G_TYPE_INT, (gint)output->node.node,
+		"is-default", G_TYPE_BOOLEAN, output->isDefault,
+		NULL);
+
+	GstHaikuAudioDevice *device = GST_HAIKUAUDIODEVICE (g_object_new (GST_TYPE_HAIKUAUDIODEVICE,
+		"display-name", output->name,
+		"caps", output->caps,
+		"device-class", "Audio/Sink",
+		"properties", props,
+		NULL));
+	device->nodeName = g_strdup (output->name);
+	device->nodeId = output->node.node;
+
+	gst_structure_free (props);
+
+	return GST_DEVICE (device);
+}
+
+static GstElement *
+gst_haikuaudio_device_create_element (GstDevice * device, const gchar * name)
+{
+	GstElement *element = gst_element_factory_make ("haikuaudiosink", name);
+	if (element != NULL) {
+		gchar *id = g_strdup_printf ("%d", (gint)GST_HAIKUAUDIODEVICE (device)->nodeId);
+		g_object_set (element, "device", id, NULL);
+		g_free (id);
+	}
+	return element;
+}
+
+static void
+gst_haikuaudio_device_finalize (GObject * object)
+{
+	GstHaikuAudioDevice *device = GST_HAIKUAUDIODEVICE (object);
+	g_free (device->nodeName);
+	G_OBJECT_CLASS (gst_haikuaudio_device_parent_class)->finalize (object);
+}
+
+static void
+gst_haikuaudio_device_class_init (GstHaikuAudioDeviceClass * klass)
+{
+	GObjectClass *gobject_class = (GObjectClass *) klass;
+	GstDeviceClass *device_class = GST_DEVICE_CLASS (klass);
+
+	gobject_class->finalize = gst_haikuaudio_device_finalize;
+	device_class->create_element = gst_haikuaudio_device_create_element;
+}
+
+static void
+gst_haikuaudio_device_init (GstHaikuAudioDevice * device)
+{
+	device->nodeName = NULL;
+	device->nodeId = -1;
+}
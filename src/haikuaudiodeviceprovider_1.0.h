@@ -0,0 +1,70 @@
+/* Haiku audio device provider for GStreamer
+ * Copyright (C) <2017-2023> Gerasim Troeglazov <3dEyes@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more 
+ */
+
+#ifndef __GST_HAIKUAUDIODEVICEPROVIDER_H__
+#define __GST_HAIKUAUDIODEVICEPROVIDER_H__
+
+
+#include <gst/gst.h>
+
+#include <Looper.h>
+#include <MediaDefs.h>
+#include <MediaNode.h>
+#include <MediaRoster.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_HAIKUAUDIODEVICEPROVIDER            (gst_haikuaudio_device_provider_get_type())
+#define GST_HAIKUAUDIODEVICEPROVIDER(obj)            (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_HAIKUAUDIODEVICEPROVIDER,GstHaikuAudioDeviceProvider))
+#define GST_IS_HAIKUAUDIODEVICEPROVIDER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_HAIKUAUDIODEVICEPROVIDER))
+
+#define GST_TYPE_HAIKUAUDIODEVICE                    (gst_haikuaudio_device_get_type())
+#define GST_HAIKUAUDIODEVICE(obj)                    (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_HAIKUAUDIODEVICE,GstHaikuAudioDevice))
+#define GST_IS_HAIKUAUDIODEVICE(obj)                 (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_HAIKUAUDIODEVICE))
+
+typedef struct _GstHaikuAudioDeviceProvider GstHaikuAudioDeviceProvider;
+typedef struct _GstHaikuAudioDeviceProviderClass GstHaikuAudioDeviceProviderClass;
+typedef struct _GstHaikuAudioDevice GstHaikuAudioDevice;
+typedef struct _GstHaikuAudioDeviceClass GstHaikuAudioDeviceClass;
+
+struct _GstHaikuAudioDeviceProvider {
+	GstDeviceProvider provider;
+};
+
+struct _GstHaikuAudioDeviceProviderClass {
+	GstDeviceProviderClass parent_class;
+};
+
+struct _GstHaikuAudioDevice {
+	GstDevice device;
+
+	gchar *nodeName;
+	media_node_id nodeId;
+};
+
+struct _GstHaikuAudioDeviceClass {
+	GstDeviceClass parent_class;
+};
+
+GType gst_haikuaudio_device_provider_get_type(void);
+GType gst_haikuaudio_device_get_type(void);
+
+/* Resolves a device node ID (or, failing that, a node name) from the
+ * cached output list, so the sink does not have to query the media
+ * roster on every player start. */
+gboolean gst_haikuaudio_device_lookup(const gchar *device, media_node *node);
+
+G_END_DECLS
+
+#endif /* __GST_HAIKUAUDIODEVICEPROVIDER_H__ */
@@ -29,11 +29,6 @@
 #define DEFAULT_VOLUME      0.6
 #define MAX_VOLUME          1.0
 
-#define HAIKU_SND_BUFFER_SIZE 1920
-#define HAIKU_SND_RATE "48000"
-#define HAIKU_SND_CHANNELS "2"
-#define HAIKU_SND_WIDTH "16"
-
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
@@ -79,12 +74,30 @@ static GstStaticPadTemplate haikuaudiosink_sink_factory =
 	GST_PAD_SINK,
 	GST_PAD_ALWAYS,
 	GST_STATIC_CAPS ("audio/x-raw-int, "
-		"endianness = (int) BYTE_ORDER, "
+		"endianness = (int) LITTLE_ENDIAN, "
+		"signed = (boolean) TRUE, "
+		"width = (int) 16, "
+		"depth = (int) 16, "
+		"rate = (int) [ 1, MAX ], "
+		"channels = (int) [ 1, 2 ]; "
+		"audio/x-raw-int, "
+		"endianness = (int) LITTLE_ENDIAN, "
 		"signed = (boolean) TRUE, "
-		"width = (int) " HAIKU_SND_WIDTH ", "
-		"depth = (int) " HAIKU_SND_WIDTH ", "
-		"rate = (int) " HAIKU_SND_RATE ", "
-		"channels = (int) " HAIKU_SND_CHANNELS)
+		"width = (int) 32, "
+		"depth = (int) 32, "
+		"rate = (int) [ 1, MAX ], "
+		"channels = (int) [ 1, 2 ]; "
+		"audio/x-raw-int, "
+		"signed = (boolean) { TRUE, FALSE }, "
+		"width = (int) 8, "
+		"depth = (int) 8, "
+		"rate = (int) [ 1, MAX ], "
+		"channels = (int) [ 1, 2 ]; "
+		"audio/x-raw-float, "
+		"endianness = (int) LITTLE_ENDIAN, "
+		"width = (int) 32, "
+		"rate = (int) [ 1, MAX ], "
+		"channels = (int) [ 1, 2 ]")
 	);
 
 GST_BOILERPLATE (GstHaikuAudioSink, gst_haikuaudio_sink, GstAudioSink, GST_TYPE_AUDIO_SINK);
@@ -149,6 +162,7 @@ gst_haikuaudio_sink_init (GstHaikuAudioSink * haikuaudiosink,
     GstHaikuAudioSinkClass * g_class)
 {
 	haikuaudiosink->buffer = NULL;
+	haikuaudiosink->m_player = NULL;
 	haikuaudiosink->nodeName = new BString("GStreamer");
 	if (be_app != NULL)  {
 		app_info appinfo;
@@ -221,8 +235,7 @@ static void
 playerProc(void *cookie, void *buffer, size_t len, const media_raw_audio_format &format)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK ((GstAudioSink*)cookie);
-	bigtime_t timeout = ((1000000 / (format.channel_count * (atoi(HAIKU_SND_WIDTH) / 8))) * len) / format.frame_rate;
-	if (acquire_sem_etc(haikuaudio->block_sem, 1, B_RELATIVE_TIMEOUT, timeout) == B_TIMED_OUT) {
+	if (acquire_sem_etc(haikuaudio->block_sem, 1, B_RELATIVE_TIMEOUT, haikuaudio->latency_time) == B_TIMED_OUT) {
 		memset(buffer, 0, len);
 		return;
 	}
@@ -235,36 +248,6 @@ gst_haikuaudio_sink_open (GstAudioSink * asink)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	uint32 segsize = HAIKU_SND_BUFFER_SIZE * atoi(HAIKU_SND_CHANNELS);
-
-	haikuaudio->mediaKitFormat = {
-		(float)atof(HAIKU_SND_RATE),
-		(uint32)atoi(HAIKU_SND_CHANNELS),
-		media_raw_audio_format::B_AUDIO_SHORT,
-		B_MEDIA_LITTLE_ENDIAN,
-		(uint32)segsize
-  	};
-
-	haikuaudio->buffer = (unsigned char*)g_malloc (segsize);
-	memset (haikuaudio->buffer, 0, segsize);
-
-	haikuaudio->m_player = new BSoundPlayer(&haikuaudio->mediaKitFormat,
-	haikuaudio->nodeName->String(), playerProc, NULL, (void*)haikuaudio);
-
-	if(haikuaudio->m_player->InitCheck() != B_OK) {
-		delete haikuaudio->m_player;
-		haikuaudio->m_player = NULL;
-		free(haikuaudio->buffer);
-		haikuaudio->buffer = NULL;
-		return FALSE;
-	}
-
-	haikuaudio->block_sem = create_sem(0, "blocker");
-	haikuaudio->unblock_sem = create_sem(1, "unblocker");
-
-	haikuaudio->m_player->Start();
-  	haikuaudio->m_player->SetHasData(true);
-
 	return TRUE;
 }
 
@@ -273,23 +256,6 @@ gst_haikuaudio_sink_close (GstAudioSink * asink)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	if(haikuaudio->m_player != NULL) {
-		haikuaudio->m_player->SetHasData(false);
-		haikuaudio->m_player->Stop();
-
-		delete_sem(haikuaudio->block_sem);
-		delete_sem(haikuaudio->unblock_sem);
-
-		delete haikuaudio->m_player;
-
-		haikuaudio->m_player = NULL;
-	}
-
-	if(haikuaudio->buffer != NULL) {
-		free(haikuaudio->buffer);
-		haikuaudio->buffer = NULL;
-	}
-
 	return TRUE;
 }
 
@@ -301,9 +267,8 @@ gst_haikuaudio_sink_write (GstAudioSink * asink, gpointer data, guint length)
 	if (length > haikuaudio->mediaKitFormat.buffer_size) {
 		length = haikuaudio->mediaKitFormat.buffer_size;
 	}
-	bigtime_t timeout = ((1000000 / ((atoi(HAIKU_SND_WIDTH) / 8 ) * atoi(HAIKU_SND_CHANNELS))) * length) / atoi(HAIKU_SND_RATE);
 
-	if (acquire_sem_etc(haikuaudio->unblock_sem, 1, B_RELATIVE_TIMEOUT, timeout) == B_TIMED_OUT) {
+	if (acquire_sem_etc(haikuaudio->unblock_sem, 1, B_RELATIVE_TIMEOUT, haikuaudio->latency_time) == B_TIMED_OUT) {
 		return 0;
 	}
 	memcpy(haikuaudio->buffer, data, length);
@@ -312,17 +277,76 @@ gst_haikuaudio_sink_write (GstAudioSink * asink, gpointer data, guint length)
 	return length;
 }
 
+static gboolean
+mediakit_format_from_spec (GstRingBufferSpec * spec, uint32 *format)
+{
+	switch (spec->format) {
+		case GST_S8:
+			*format = media_raw_audio_format::B_AUDIO_CHAR;
+			return TRUE;
+
+		case GST_U8:
+			*format = media_raw_audio_format::B_AUDIO_UCHAR;
+			return TRUE;
+
+		case GST_S16_LE:
+			*format = media_raw_audio_format::B_AUDIO_SHORT;
+			return TRUE;
+
+		case GST_S32_LE:
+			*format = media_raw_audio_format::B_AUDIO_INT;
+			return TRUE;
+
+		case GST_FLOAT32_LE:
+			*format = media_raw_audio_format::B_AUDIO_FLOAT;
+			return TRUE;
+
+		default:
+			return FALSE;
+	}
+}
+
 static gboolean
 gst_haikuaudio_sink_prepare (GstAudioSink * asink, GstRingBufferSpec * spec)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	if (spec->format != GST_S16_LE)
+	uint32 format;
+	if (!mediakit_format_from_spec(spec, &format))
 		return FALSE;
-	if (spec->width != atoi(HAIKU_SND_WIDTH))
+
+	haikuaudio->latency_time = spec->latency_time;
+	spec->segsize = (spec->latency_time * spec->rate / G_USEC_PER_SEC) * spec->bytes_per_sample;
+
+	haikuaudio->mediaKitFormat = {
+		(float)spec->rate,
+		(uint32)spec->channels,
+		format,
+		B_MEDIA_LITTLE_ENDIAN,
+		(uint32)spec->segsize
+  	};
+
+	haikuaudio->buffer = (unsigned char*)g_malloc (spec->segsize);
+	memset (haikuaudio->buffer, 0, spec->segsize);
+
+	haikuaudio->m_player = new BSoundPlayer(&haikuaudio->mediaKitFormat,
+	haikuaudio->nodeName->String(), playerProc, NULL, (void*)haikuaudio);
+
+	if(haikuaudio->m_player->InitCheck() != B_OK) {
+		delete haikuaudio->m_player;
+		haikuaudio->m_player = NULL;
+		g_free(haikuaudio->buffer);
+		haikuaudio->buffer = NULL;
 		return FALSE;
+	}
 
-	spec->segsize = HAIKU_SND_BUFFER_SIZE * spec->channels;
+	haikuaudio->block_sem = create_sem(0, "blocker");
+	haikuaudio->unblock_sem = create_sem(1, "unblocker");
+
+	haikuaudio->m_player->Start();
+  	haikuaudio->m_player->SetHasData(true);
+
+	gst_haikuaudio_sink_set_volume (haikuaudio);
 
 	return TRUE;
 }
@@ -332,5 +356,22 @@ gst_haikuaudio_sink_unprepare (GstAudioSink * asink)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
+	if(haikuaudio->m_player != NULL) {
+		haikuaudio->m_player->SetHasData(false);
+		haikuaudio->m_player->Stop();
+
+		delete_sem(haikuaudio->block_sem);
+		delete_sem(haikuaudio->unblock_sem);
+
+		delete haikuaudio->m_player;
+
+		haikuaudio->m_player = NULL;
+	}
+
+	if(haikuaudio->buffer != NULL) {
+		g_free(haikuaudio->buffer);
+		haikuaudio->buffer = NULL;
+	}
+
 	return TRUE;
 }
@@ -46,6 +46,7 @@ struct _GstHaikuAudioSink {
 	guint8 *buffer;
 
 	media_raw_audio_format mediaKitFormat;
+	bigtime_t latency_time;
 
 	sem_id block_sem;
 	sem_id unblock_sem;
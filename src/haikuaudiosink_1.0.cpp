@@ -17,9 +17,16 @@
 #endif
 
 #include "haikuaudiosink_1.0.h"
+#include "haikuaudiodeviceprovider_1.0.h"
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define GST_PACKAGE_NAME "Gstreamer"
 #define GST_PACKAGE_ORIGIN "GStreamer community"
 #define VERSION "1.20.4"
@@ -29,12 +36,42 @@
 #define DEFAULT_VOLUME      0.6
 #define MAX_VOLUME          1.0
 
+#define DEFAULT_FLIGHT_RECORDER 0
+#define MAX_FLIGHT_RECORDER     60
+#define RECORDER_BURST          3
+
+#define SYNC_GROUP_LEAD     (G_USEC_PER_SEC / 10)
+
+#define GATE_SPIN           256
+
+/* how long a player is kept running after the ring buffer stops, so that
+ * the stop/unprepare/prepare/resume of a caps change does not restart it */
+#define PLAYER_LINGER       (G_USEC_PER_SEC / 2)
+#define WEBAPP_LINGER       G_USEC_PER_SEC
+
+#define DEFAULT_LEVEL_INTERVAL 0
+#define LEVEL_PEAK_FALLOFF     10.0
+#define DEFAULT_IDLE_TIMEOUT   0
+
+#define LATENCY_CHECK_INTERVAL G_USEC_PER_SEC
+#define LATENCY_CHANGE_LIMIT   (G_USEC_PER_SEC / 500)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define GATE_PAUSE()        __builtin_ia32_pause()
+#else
+#define GATE_PAUSE()
+#endif
+
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
 	if (!gst_element_register (plugin, "haikuaudiosink", GST_RANK_PRIMARY, GST_TYPE_HAIKUAUDIOSINK))
 		return FALSE;
 
+	if (!gst_device_provider_register (plugin, "haikuaudiodeviceprovider", GST_RANK_PRIMARY,
+			GST_TYPE_HAIKUAUDIODEVICEPROVIDER))
+		return FALSE;
+
 	return TRUE;
 }
 
@@ -48,10 +85,14 @@ GST_PLUGIN_DEFINE (GST_VERSION_MAJOR,
 
 static void gst_haikuaudio_sink_dispose (GObject * object);
 static GstCaps *gst_haikuaudio_sink_getcaps (GstBaseSink * bsink, GstCaps * filter);
+static gboolean gst_haikuaudio_sink_query (GstBaseSink * bsink, GstQuery * query);
 static gboolean gst_haikuaudio_sink_open (GstAudioSink * asink);
 static gboolean gst_haikuaudio_sink_close (GstAudioSink * asink);
 static gboolean gst_haikuaudio_sink_prepare (GstAudioSink * asink, GstAudioRingBufferSpec * spec);
 static gboolean gst_haikuaudio_sink_unprepare (GstAudioSink * asink);
+static void gst_haikuaudio_sink_pause (GstAudioSink * asink);
+static void gst_haikuaudio_sink_resume (GstAudioSink * asink);
+static void gst_haikuaudio_sink_stop (GstAudioSink * asink);
 static void gst_haikuaudio_sink_base_init (gpointer g_class);
 static void gst_haikuaudio_sink_class_init (GstHaikuAudioSinkClass * klass);
 static void gst_haikuaudio_sink_init (GstHaikuAudioSink * haikuaudiosink, GstHaikuAudioSinkClass * g_class);
@@ -67,12 +108,38 @@ static void gst_haikuaudio_sink_set_property (GObject * object, guint prop_id, c
 static void gst_haikuaudio_sink_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec);
 
 static void gst_haikuaudio_sink_soundplayer_delete (GstHaikuAudioSink * sink);
+static void gst_haikuaudio_sink_idle_set (GstHaikuAudioSink * sink, gboolean idle);
+static GstAudioFormat gst_format_from_mediakit (uint32 format);
+
+static void gst_haikuaudio_sink_reset_stats (GstHaikuAudioSink * sink);
+static GstStructure *gst_haikuaudio_sink_get_stats (GstHaikuAudioSink * sink);
+
+static void gst_haikuaudio_sink_sync_join (GstHaikuAudioSink * sink);
+static void gst_haikuaudio_sink_sync_leave (GstHaikuAudioSink * sink);
+static void gst_haikuaudio_sink_sync_arm (GstHaikuAudioSink * sink);
+
+static void gst_haikuaudio_sink_recorder_create (GstHaikuAudioSink * sink);
+static void gst_haikuaudio_sink_recorder_delete (GstHaikuAudioSink * sink);
+static gboolean gst_haikuaudio_sink_recorder_dump (GstHaikuAudioSink * sink);
+
+enum
+{
+  SIGNAL_DUMP_FLIGHT_RECORDER,
+  LAST_SIGNAL
+};
 
 enum
 {
   ARG_0,
   ARG_VOLUME,
-  ARG_MUTE
+  ARG_MUTE,
+  ARG_STATS,
+  ARG_FLIGHT_RECORDER,
+  ARG_FLIGHT_RECORDER_LOCATION,
+  ARG_DEVICE,
+  ARG_SYNC_GROUP,
+  ARG_LEVEL_INTERVAL,
+  ARG_IDLE_TIMEOUT
 };
 
 static GstStaticPadTemplate haikuaudiosink_sink_factory =
@@ -87,6 +154,18 @@ static GstStaticPadTemplate haikuaudiosink_sink_factory =
 	);
 
 static GstElementClass *parent_class = NULL;
+static guint gst_haikuaudio_sink_signals[LAST_SIGNAL] = { 0 };
+
+struct _GstHaikuAudioSinkSyncGroup {
+	gchar *name;
+	GList *members;
+	bigtime_t startTime;
+	/* members whose syncStart is this startTime */
+	int32 armed;
+};
+
+static GMutex sync_groups_lock;
+static GHashTable *sync_groups = NULL;
 
 GType
 gst_haikuaudio_sink_get_type (void)
@@ -146,12 +225,18 @@ gst_haikuaudio_sink_class_init (GstHaikuAudioSinkClass * klass)
 	gobject_class->dispose = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_dispose);
 	
 	gstbasesink_class->get_caps = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_getcaps);
+	gstbasesink_class->query = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_query);
 	
 	gstaudiosink_class->open = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_open);
 	gstaudiosink_class->close = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_close);
 	gstaudiosink_class->prepare = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_prepare);
 	gstaudiosink_class->unprepare = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_unprepare);
 	gstaudiosink_class->write = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_write);
+	gstaudiosink_class->pause = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_pause);
+	gstaudiosink_class->resume = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_resume);
+	gstaudiosink_class->stop = GST_DEBUG_FUNCPTR (gst_haikuaudio_sink_stop);
+
+	klass->dump_flight_recorder = gst_haikuaudio_sink_recorder_dump;
 
 	gobject_class->finalize = gst_haikuaudio_sink_finalize;
 	gobject_class->set_property = gst_haikuaudio_sink_set_property;
@@ -168,6 +253,61 @@ gst_haikuaudio_sink_class_init (GstHaikuAudioSinkClass * klass)
 		g_param_spec_boolean ("mute", "Mute",
 			"Mute state of this stream", DEFAULT_MUTE,
 			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_STATS,
+		g_param_spec_boxed ("playback-stats", "Playback statistics",
+			"Hand-off latency, jitter and underrun counters since the last prepare; "
+				"underruns only count while the ring buffer is started, buffer-allocations "
+				"(hand-off and conversion buffers grown) and player-creations cover the "
+				"lifetime of the sink",
+			GST_TYPE_STRUCTURE, (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_FLIGHT_RECORDER,
+		g_param_spec_uint ("flight-recorder", "Flight recorder",
+			"Seconds of callback output kept for post-mortem dumps, 0=disabled (applied when the player starts)",
+			0, MAX_FLIGHT_RECORDER, DEFAULT_FLIGHT_RECORDER,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_FLIGHT_RECORDER_LOCATION,
+		g_param_spec_string ("flight-recorder-location", "Flight recorder location",
+			"Directory flight recorder dumps are written to, NULL=temporary directory", NULL,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_DEVICE,
+		g_param_spec_string ("device", "Device",
+			"MediaKit output node ID or name, NULL=system mixer (applied when the player starts)", NULL,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_SYNC_GROUP,
+		g_param_spec_string ("sync-group", "Sync group",
+			"Sinks with the same group name start playout at the same frame, NULL=none (applied when the player starts; "
+				"skipped while the stream is converted to the format of a player kept across a caps change)", NULL,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_LEVEL_INTERVAL,
+		g_param_spec_uint64 ("level-interval", "Level interval",
+			"Interval in ns between \"level\" element messages with the peak and RMS of the output, 0=disabled",
+			0, G_MAXUINT64, DEFAULT_LEVEL_INTERVAL,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	g_object_class_install_property (gobject_class,
+		ARG_IDLE_TIMEOUT,
+		g_param_spec_uint64 ("idle-timeout", "Idle timeout",
+			"Time in ns of silence or starvation after which the mixer stops pulling from the player, 0=disabled",
+			0, G_MAXINT64, DEFAULT_IDLE_TIMEOUT,
+			(GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	gst_haikuaudio_sink_signals[SIGNAL_DUMP_FLIGHT_RECORDER] =
+		g_signal_new ("dump-flight-recorder", G_TYPE_FROM_CLASS (klass),
+			(GSignalFlags)(G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION),
+			G_STRUCT_OFFSET (GstHaikuAudioSinkClass, dump_flight_recorder),
+			NULL, NULL, NULL, G_TYPE_BOOLEAN, 0);
 }
 
 static void
@@ -176,6 +316,54 @@ gst_haikuaudio_sink_init (GstHaikuAudioSink * haikuaudiosink,
 {
 	haikuaudiosink->is_webapp = FALSE;
 	haikuaudiosink->buffer = NULL;
+	haikuaudiosink->bufferSize = 0;
+	haikuaudiosink->segmentLength = 0;
+	haikuaudiosink->segmentTime = 0;
+	haikuaudiosink->readOffset = 0;
+	haikuaudiosink->holding = FALSE;
+	haikuaudiosink->syncGroupName = NULL;
+	haikuaudiosink->syncGroup = NULL;
+	haikuaudiosink->syncStarted = FALSE;
+	haikuaudiosink->levelInterval = DEFAULT_LEVEL_INTERVAL;
+	haikuaudiosink->levelSeq = 0;
+	haikuaudiosink->levelPosted = 0;
+	haikuaudiosink->levelDurationOut = 0;
+	haikuaudiosink->levelChannelsOut = 0;
+	haikuaudiosink->levelEndOut = 0;
+	haikuaudiosink->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+	haikuaudiosink->idleRequest = 0;
+	haikuaudiosink->playerLatency = 0;
+	haikuaudiosink->reportedLatency = 0;
+	haikuaudiosink->latencyCheckTime = 0;
+	haikuaudiosink->idle = 0;
+	haikuaudiosink->silentSince = 0;
+	haikuaudiosink->starvedSince = 0;
+	haikuaudiosink->soundPlayer = NULL;
+	haikuaudiosink->playerRunning = FALSE;
+	haikuaudiosink->streaming = 0;
+	haikuaudiosink->stoppedSince = 0;
+	haikuaudiosink->statAllocations = 0;
+	haikuaudiosink->statPlayers = 0;
+	haikuaudiosink->statCallbackCpu = 0;
+	haikuaudiosink->callbackThread = -1;
+	haikuaudiosink->callbackCpuBase = 0;
+	haikuaudiosink->playerDevice = NULL;
+	haikuaudiosink->converter = NULL;
+	haikuaudiosink->convertBuffer = NULL;
+	haikuaudiosink->convertBufferSize = 0;
+	g_mutex_init (&haikuaudiosink->configLock);
+	haikuaudiosink->device = NULL;
+	g_rec_mutex_init (&haikuaudiosink->playerLock);
+
+	haikuaudiosink->blockGate.count = 0;
+	haikuaudiosink->blockGate.sem = create_sem(0, "blocker");
+	haikuaudiosink->unblockGate.count = 1;
+	haikuaudiosink->unblockGate.sem = create_sem(0, "unblocker");
+
+	haikuaudiosink->monitorThread = -1;
+	haikuaudiosink->monitorSem = create_sem(0, "monitor");
+	haikuaudiosink->monitorActive = 0;
+	haikuaudiosink->monitorQuit = 0;
 	haikuaudiosink->nodeName = new BString("GStreamer");
 	if (be_app != NULL)  {
 		app_info appinfo;
@@ -204,13 +392,45 @@ gst_haikuaudio_sink_init (GstHaikuAudioSink * haikuaudiosink,
 	}
 	haikuaudiosink->volume = DEFAULT_VOLUME;
 	haikuaudiosink->mute = DEFAULT_MUTE;
+
+	haikuaudiosink->recorderSeconds = DEFAULT_FLIGHT_RECORDER;
+	haikuaudiosink->recorderLocation = NULL;
+	haikuaudiosink->recorderArea = -1;
+	haikuaudiosink->recorderHeader = NULL;
+	g_mutex_init (&haikuaudiosink->recorderLock);
 }
 
 static void
 gst_haikuaudio_sink_finalize (GObject * object)
 {
 	GstHaikuAudioSink *sink = GST_HAIKUAUDIOSINK (object);
+
+	if (sink->monitorThread >= 0) {
+		status_t status;
+		atomic_set(&sink->monitorQuit, 1);
+		release_sem(sink->monitorSem);
+		wait_for_thread(sink->monitorThread, &status);
+	}
+
 	gst_haikuaudio_sink_soundplayer_delete(sink);
+	gst_haikuaudio_sink_sync_leave(sink);
+	gst_haikuaudio_sink_recorder_delete(sink);
+
+	delete_sem(sink->blockGate.sem);
+	delete_sem(sink->unblockGate.sem);
+	delete_sem(sink->monitorSem);
+	g_free (sink->buffer);
+	g_free (sink->convertBuffer);
+	if (sink->converter != NULL)
+		gst_audio_converter_free (sink->converter);
+
+	g_rec_mutex_clear (&sink->playerLock);
+	g_mutex_clear (&sink->configLock);
+	g_mutex_clear (&sink->recorderLock);
+	g_free (sink->recorderLocation);
+	g_free (sink->playerDevice);
+	g_free (sink->device);
+	g_free (sink->syncGroupName);
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -230,6 +450,31 @@ gst_haikuaudio_sink_getcaps (GstBaseSink * bsink, GstCaps * filter)
   return caps;
 }
 
+/* The base class accounts for the ring buffer; on top of it a segment can
+ * wait up to one period in the hand-off buffer and MediaKit adds the
+ * player's downstream latency. */
+static gboolean
+gst_haikuaudio_sink_query (GstBaseSink * bsink, GstQuery * query)
+{
+	GstHaikuAudioSink *sink = GST_HAIKUAUDIOSINK (bsink);
+
+	gboolean res = GST_BASE_SINK_CLASS (parent_class)->query (bsink, query);
+
+	if (res && GST_QUERY_TYPE (query) == GST_QUERY_LATENCY) {
+		gboolean live;
+		GstClockTime min, max;
+		GstClockTime extra = (GstClockTime)atomic_get64(&sink->reportedLatency) * GST_USECOND;
+
+		gst_query_parse_latency (query, &live, &min, &max);
+		min += extra;
+		if (GST_CLOCK_TIME_IS_VALID (max))
+			max += extra;
+		gst_query_set_latency (query, live, min, max);
+	}
+
+	return res;
+}
+
 static void
 gst_haikuaudio_sink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -243,6 +488,33 @@ gst_haikuaudio_sink_set_property (GObject * object, guint prop_id,
 		case ARG_MUTE:
 			gst_haikuaudio_sink_set_mute (sink, g_value_get_boolean (value));
 			break;
+		case ARG_FLIGHT_RECORDER:
+			sink->recorderSeconds = g_value_get_uint (value);
+			break;
+		case ARG_FLIGHT_RECORDER_LOCATION:
+			GST_OBJECT_LOCK (sink);
+			g_free (sink->recorderLocation);
+			sink->recorderLocation = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_DEVICE:
+			GST_OBJECT_LOCK (sink);
+			g_free (sink->device);
+			sink->device = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_SYNC_GROUP:
+			GST_OBJECT_LOCK (sink);
+			g_free (sink->syncGroupName);
+			sink->syncGroupName = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_LEVEL_INTERVAL:
+			atomic_set64(&sink->levelInterval, (int64)MIN(g_value_get_uint64 (value), (guint64)G_MAXINT64));
+			break;
+		case ARG_IDLE_TIMEOUT:
+			atomic_set64(&sink->idleTimeout, (int64)g_value_get_uint64 (value));
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -262,6 +534,33 @@ gst_haikuaudio_sink_get_property (GObject * object, guint prop_id,
 		case ARG_MUTE:
 			g_value_set_boolean (value, gst_haikuaudio_sink_get_mute (sink));
 			break;
+		case ARG_STATS:
+			g_value_take_boxed (value, gst_haikuaudio_sink_get_stats (sink));
+			break;
+		case ARG_FLIGHT_RECORDER:
+			g_value_set_uint (value, sink->recorderSeconds);
+			break;
+		case ARG_FLIGHT_RECORDER_LOCATION:
+			GST_OBJECT_LOCK (sink);
+			g_value_set_string (value, sink->recorderLocation);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_DEVICE:
+			GST_OBJECT_LOCK (sink);
+			g_value_set_string (value, sink->device);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_SYNC_GROUP:
+			GST_OBJECT_LOCK (sink);
+			g_value_set_string (value, sink->syncGroupName);
+			GST_OBJECT_UNLOCK (sink);
+			break;
+		case ARG_LEVEL_INTERVAL:
+			g_value_set_uint64 (value, (guint64)atomic_get64(&sink->levelInterval));
+			break;
+		case ARG_IDLE_TIMEOUT:
+			g_value_set_uint64 (value, (guint64)atomic_get64(&sink->idleTimeout));
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -274,19 +573,20 @@ gst_haikuaudio_sink_set_volume (GstHaikuAudioSink * sink, gdouble dvolume, gbool
 	if (store)
 		sink->volume = dvolume;
 
-	if (sink->soundPlayer == NULL)
-		return;
-	if (sink->soundPlayer->InitCheck() != B_OK)
-		return;
-
-	sink->soundPlayer->SetVolume((float)dvolume);
+	/* the monitor may delete the player at any time */
+	g_rec_mutex_lock (&sink->playerLock);
+	if (sink->soundPlayer != NULL && sink->soundPlayer->InitCheck() == B_OK)
+		sink->soundPlayer->SetVolume((float)dvolume);
+	g_rec_mutex_unlock (&sink->playerLock);
 }
 
 gdouble
 gst_haikuaudio_sink_get_volume (GstHaikuAudioSink * sink)
 {
+	g_rec_mutex_lock (&sink->playerLock);
 	if (sink->soundPlayer != NULL)
 		sink->volume = (gdouble)sink->soundPlayer->Volume();
+	g_rec_mutex_unlock (&sink->playerLock);
 
 	return (gdouble)sink->volume;
 }
@@ -309,71 +609,1158 @@ gst_haikuaudio_sink_get_mute (GstHaikuAudioSink * sink)
   return sink->mute;
 }
 
+static int
+gst_haikuaudio_sink_latency_bucket (bigtime_t latency)
+{
+	int bucket = 0;
+	while (latency > 0 && bucket < GST_HAIKUAUDIOSINK_LATENCY_BUCKETS - 1) {
+		latency >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* Called on every prepare. Allocations and player creations are kept, they
+ * are what shows whether resources are reused across prepare cycles. */
+static void
+gst_haikuaudio_sink_reset_stats (GstHaikuAudioSink * sink)
+{
+	atomic_set64(&sink->statSegments, 0);
+	atomic_set64(&sink->statCallbacks, 0);
+	atomic_set64(&sink->statUnderruns, 0);
+	atomic_set64(&sink->statWriteTimeouts, 0);
+	atomic_set64(&sink->statWriteFast, 0);
+	atomic_set64(&sink->statWriteSlow, 0);
+	atomic_set64(&sink->statCallbackFast, 0);
+	atomic_set64(&sink->statCallbackSlow, 0);
+	atomic_set64(&sink->statIdleEntries, 0);
+	atomic_set64(&sink->statSyncOffset, 0);
+	atomic_set64(&sink->statFrames, 0);
+	atomic_set64(&sink->statPlayoutTime, 0);
+	atomic_set64(&sink->statStreamTime, 0);
+	atomic_set64(&sink->statCallbackCpu, 0);
+	atomic_set(&sink->callbackThread, -1);
+	atomic_set64(&sink->statJitterSum, 0);
+	atomic_set64(&sink->statJitterMax, 0);
+	for (int i = 0; i < GST_HAIKUAUDIOSINK_LATENCY_BUCKETS; i++)
+		atomic_set64(&sink->statLatencyHist[i], 0);
+	sink->lastCallbackTime = 0;
+}
+
+/* CPU time a thread used so far, or -1 once it is gone. */
+static bigtime_t
+gst_haikuaudio_sink_thread_cpu (thread_id thread)
+{
+	thread_info info;
+	if (thread < 0 || get_thread_info(thread, &info) != B_OK)
+		return -1;
+	return info.user_time + info.kernel_time;
+}
+
+/* Called before the player and its thread go away, so the CPU time that
+ * thread spent is kept in the stats. */
+static void
+gst_haikuaudio_sink_callback_cpu_fold (GstHaikuAudioSink * sink)
+{
+	bigtime_t cpu = gst_haikuaudio_sink_thread_cpu(atomic_get(&sink->callbackThread));
+	if (cpu >= 0)
+		atomic_add64(&sink->statCallbackCpu, cpu - atomic_get64(&sink->callbackCpuBase));
+	atomic_set(&sink->callbackThread, -1);
+}
+
+static bigtime_t
+gst_haikuaudio_sink_latency_percentile (const int64 *hist, int64 total, int percent)
+{
+	if (total == 0)
+		return 0;
+
+	int64 wanted = (total * percent + 99) / 100;
+	int64 seen = 0;
+	for (int i = 0; i < GST_HAIKUAUDIOSINK_LATENCY_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= wanted)
+			return (bigtime_t)1 << i;
+	}
+	return (bigtime_t)1 << (GST_HAIKUAUDIOSINK_LATENCY_BUCKETS - 1);
+}
+
+static GstStructure *
+gst_haikuaudio_sink_get_stats (GstHaikuAudioSink * sink)
+{
+	int64 hist[GST_HAIKUAUDIOSINK_LATENCY_BUCKETS];
+	int64 handoffs = 0;
+	for (int i = 0; i < GST_HAIKUAUDIOSINK_LATENCY_BUCKETS; i++) {
+		hist[i] = atomic_get64(&sink->statLatencyHist[i]);
+		handoffs += hist[i];
+	}
+
+	int64 segments = atomic_get64(&sink->statSegments);
+	int64 callbacks = atomic_get64(&sink->statCallbacks);
+	int64 frames = atomic_get64(&sink->statFrames);
+	int64 callbackCpu = atomic_get64(&sink->statCallbackCpu);
+	bigtime_t threadCpu = gst_haikuaudio_sink_thread_cpu(atomic_get(&sink->callbackThread));
+	if (threadCpu >= 0)
+		callbackCpu += threadCpu - atomic_get64(&sink->callbackCpuBase);
+
+	/* spread of the measured start offsets over the group's started members */
+	int64 syncSkew = 0;
+	g_mutex_lock (&sync_groups_lock);
+	if (sink->syncGroup != NULL) {
+		int64 minOffset = G_MAXINT64, maxOffset = G_MININT64;
+		for (GList *item = sink->syncGroup->members; item != NULL; item = item->next) {
+			GstHaikuAudioSink *member = (GstHaikuAudioSink*)item->data;
+			if (!member->syncStarted)
+				continue;
+			int64 offset = atomic_get64(&member->statSyncOffset);
+			minOffset = MIN(minOffset, offset);
+			maxOffset = MAX(maxOffset, offset);
+		}
+		if (maxOffset >= minOffset)
+			syncSkew = maxOffset - minOffset;
+	}
+	g_mutex_unlock (&sync_groups_lock);
+
+	/* user and kernel time of the player thread per second of audio,
+	 * both in microseconds */
+	double cpuPerSecond = 0.0;
+	if (frames > 0 && sink->mediaKitFormat.frame_rate > 0)
+		cpuPerSecond = (double)callbackCpu * sink->mediaKitFormat.frame_rate / frames;
+
+	return gst_structure_new ("GstHaikuAudioSinkStats",
+		"segments", G_TYPE_UINT64, (guint64)segments,
+		"callbacks", G_TYPE_UINT64, (guint64)callbacks,
+		"underruns", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statUnderruns),
+		"write-timeouts", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statWriteTimeouts),
+		"write-fast", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statWriteFast),
+		"write-slow", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statWriteSlow),
+		"callback-fast", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statCallbackFast),
+		"callback-slow", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statCallbackSlow),
+		"frames", G_TYPE_UINT64, (guint64)frames,
+		"latency", G_TYPE_UINT64, (guint64)atomic_get64(&sink->reportedLatency),
+		"drift", G_TYPE_INT64, (gint64)(atomic_get64(&sink->statPlayoutTime) - atomic_get64(&sink->statStreamTime)),
+		"latency-p50", G_TYPE_UINT64, (guint64)gst_haikuaudio_sink_latency_percentile(hist, handoffs, 50),
+		"latency-p95", G_TYPE_UINT64, (guint64)gst_haikuaudio_sink_latency_percentile(hist, handoffs, 95),
+		"latency-p99", G_TYPE_UINT64, (guint64)gst_haikuaudio_sink_latency_percentile(hist, handoffs, 99),
+		"jitter-avg", G_TYPE_UINT64, (guint64)(callbacks > 1 ? atomic_get64(&sink->statJitterSum) / (callbacks - 1) : 0),
+		"jitter-max", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statJitterMax),
+		"callback-cpu-usec-per-sec", G_TYPE_DOUBLE, cpuPerSecond,
+		"buffer-allocations", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statAllocations),
+		"player-creations", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statPlayers),
+		"idle-entries", G_TYPE_UINT64, (guint64)atomic_get64(&sink->statIdleEntries),
+		"sync-offset", G_TYPE_INT64, (gint64)atomic_get64(&sink->statSyncOffset),
+		"sync-group-skew", G_TYPE_INT64, (gint64)syncSkew,
+		NULL);
+}
+
+static void
+gst_haikuaudio_sink_recorder_create (GstHaikuAudioSink * sink)
+{
+	if (sink->recorderSeconds == 0) {
+		gst_haikuaudio_sink_recorder_delete(sink);
+		return;
+	}
+
+	const media_raw_audio_format &format = sink->playerFormat;
+	uint32 bytesPerFrame = format.channel_count * (format.format & media_raw_audio_format::B_AUDIO_SIZE_MASK);
+	uint32 recordCount = (uint32)(sink->recorderSeconds * G_USEC_PER_SEC / MAX(sink->latency_time, 1)) + 1;
+	uint64 sampleSize = (uint64)(sink->recorderSeconds * format.frame_rate) * bytesPerFrame;
+
+	GstHaikuAudioSinkRecorderHeader *current = sink->recorderHeader;
+	if (current != NULL) {
+		if (current->recordCount == recordCount && current->sampleSize == sampleSize &&
+			current->frameRate == format.frame_rate &&
+			current->channelCount == format.channel_count &&
+			current->format == format.format) {
+			g_mutex_lock (&sink->recorderLock);
+			current->position = 0;
+			current->records = 0;
+			sink->recorderTimeouts = 0;
+			sink->recorderDumpPending = 0;
+			g_mutex_unlock (&sink->recorderLock);
+			return;
+		}
+		gst_haikuaudio_sink_recorder_delete(sink);
+	}
+
+	size_t size = sizeof(GstHaikuAudioSinkRecorderHeader) + recordCount * sizeof(GstHaikuAudioSinkRecord) + sampleSize;
+	size = (size + B_PAGE_SIZE - 1) & ~(B_PAGE_SIZE - 1);
+
+	/* fully locked, so appending from the callback never faults a page in */
+	void *address = NULL;
+	area_id area = create_area("haikuaudiosink flight recorder", &address, B_ANY_ADDRESS,
+		size, B_FULL_LOCK, B_READ_AREA | B_WRITE_AREA);
+	if (area < B_OK)
+		return;
+
+	GstHaikuAudioSinkRecorderHeader *header = (GstHaikuAudioSinkRecorderHeader*)address;
+	header->magic = GST_HAIKUAUDIOSINK_RECORDER_MAGIC;
+	header->version = GST_HAIKUAUDIOSINK_RECORDER_VERSION;
+	header->frameRate = format.frame_rate;
+	header->channelCount = format.channel_count;
+	header->format = format.format;
+	header->recordCount = recordCount;
+	header->sampleSize = sampleSize;
+	header->position = 0;
+	header->records = 0;
+
+	g_mutex_lock (&sink->recorderLock);
+	sink->recorderArea = area;
+	sink->recorderRecords = (GstHaikuAudioSinkRecord*)(header + 1);
+	sink->recorderSamples = (guint8*)(sink->recorderRecords + recordCount);
+	sink->recorderTimeouts = 0;
+	sink->recorderDumpPending = 0;
+	sink->recorderHeader = header;
+	g_mutex_unlock (&sink->recorderLock);
+}
+
+static void
+gst_haikuaudio_sink_recorder_delete (GstHaikuAudioSink * sink)
+{
+	g_mutex_lock (&sink->recorderLock);
+	if (sink->recorderArea >= B_OK) {
+		sink->recorderHeader = NULL;
+		delete_area(sink->recorderArea);
+		sink->recorderArea = -1;
+	}
+	g_mutex_unlock (&sink->recorderLock);
+}
+
+/* Called from the callback only, so there is a single writer and the
+ * positions are published with atomics after the data is in place. */
+static void
+gst_haikuaudio_sink_recorder_append (GstHaikuAudioSink * sink, const void *data, size_t length,
+	bigtime_t time, bigtime_t wait, uint32 flags, int32 queued)
+{
+	GstHaikuAudioSinkRecorderHeader *header = sink->recorderHeader;
+	if (header == NULL)
+		return;
+
+	int64 position = header->position;
+	size_t stored = MIN(length, header->sampleSize);
+	size_t offset = position % header->sampleSize;
+	size_t first = MIN(stored, header->sampleSize - offset);
+
+	if (data != NULL) {
+		memcpy(sink->recorderSamples + offset, data, first);
+		memcpy(sink->recorderSamples, (const guint8*)data + first, stored - first);
+	} else {
+		memset(sink->recorderSamples + offset, 0, first);
+		memset(sink->recorderSamples, 0, stored - first);
+	}
+
+	GstHaikuAudioSinkRecord *record = &sink->recorderRecords[header->records % header->recordCount];
+	record->time = time;
+	record->wait = wait;
+	record->position = position;
+	record->length = length;
+	record->flags = (uint16)flags;
+	record->queued = (uint16)MIN(MAX(queued, 0), G_MAXUINT16);
+
+	atomic_add64(&header->position, length);
+	atomic_add64(&header->records, 1);
+
+	if ((flags & GST_HAIKUAUDIOSINK_RECORD_TIMEOUT) != 0) {
+		/* the dump itself is written by the monitor thread */
+		if (atomic_add(&sink->recorderTimeouts, 1) + 1 == RECORDER_BURST) {
+			atomic_set(&sink->recorderDumpPending, 1);
+			release_sem_etc(sink->monitorSem, 1, B_DO_NOT_RESCHEDULE);
+		}
+	} else {
+		sink->recorderTimeouts = 0;
+	}
+}
+
+static gboolean
+gst_haikuaudio_sink_recorder_dump (GstHaikuAudioSink * sink)
+{
+	gboolean result = FALSE;
+
+	g_mutex_lock (&sink->recorderLock);
+
+	GstHaikuAudioSinkRecorderHeader *header = sink->recorderHeader;
+	if (header != NULL) {
+		/* records and samples are stored oldest first, so readers of the
+		 * dump need no ring arithmetic; the callback keeps appending and
+		 * the oldest entries may be torn */
+		GstHaikuAudioSinkRecorderHeader snapshot = *header;
+		snapshot.position = atomic_get64(&header->position);
+		snapshot.records = atomic_get64(&header->records);
+		int64 records = MIN(snapshot.records, (int64)header->recordCount);
+		int64 samples = MIN(snapshot.position, (int64)header->sampleSize);
+		snapshot.recordCount = (uint32)records;
+		snapshot.sampleSize = (uint64)samples;
+
+		GST_OBJECT_LOCK (sink);
+		gchar *location = g_strdup (sink->recorderLocation);
+		GST_OBJECT_UNLOCK (sink);
+
+		gchar *name = g_strdup_printf ("haikuaudiosink-%" G_GINT64_FORMAT ".rec", (gint64)real_time_clock_usecs());
+		gchar *path = g_build_filename (location != NULL ? location : g_get_tmp_dir(), name, NULL);
+
+		FILE *file = fopen(path, "wb");
+		if (file != NULL) {
+			result = fwrite(&snapshot, sizeof(snapshot), 1, file) == 1;
+			for (int64 i = snapshot.records - records; i < snapshot.records && result; i++)
+				result = fwrite(&sink->recorderRecords[i % header->recordCount],
+					sizeof(GstHaikuAudioSinkRecord), 1, file) == 1;
+
+			size_t offset = (snapshot.position - samples) % header->sampleSize;
+			size_t first = MIN((size_t)samples, header->sampleSize - offset);
+			if (result)
+				result = fwrite(sink->recorderSamples + offset, 1, first, file) == first &&
+					fwrite(sink->recorderSamples, 1, (size_t)samples - first, file) == (size_t)samples - first;
+
+			if (fclose(file) != 0)
+				result = FALSE;
+		}
+
+		g_free (path);
+		g_free (name);
+		g_free (location);
+	}
+
+	g_mutex_unlock (&sink->recorderLock);
+
+	return result;
+}
+
+/* Takes one unit, spinning briefly for the peer before sleeping on the
+ * semaphore until deadline. Each gate has a single waiter. */
+static status_t
+gst_haikuaudio_sink_gate_acquire (GstHaikuAudioSinkGate *gate, bigtime_t deadline,
+	int64 *fastCount, int64 *slowCount)
+{
+	for (int i = 0; i < GATE_SPIN && atomic_get(&gate->count) <= 0; i++)
+		GATE_PAUSE();
+
+	if (atomic_add(&gate->count, -1) > 0) {
+		atomic_add64(fastCount, 1);
+		return B_OK;
+	}
+
+	atomic_add64(slowCount, 1);
+	status_t status = acquire_sem_etc(gate->sem, 1, B_ABSOLUTE_TIMEOUT, deadline);
+	if (status == B_OK)
+		return B_OK;
+
+	/* withdraw the wait, but only while it is still registered: once a
+	 * release raced with the timeout, count is back at 0 and the semaphore
+	 * holds our unit, so take it instead */
+	int32 count = atomic_get(&gate->count);
+	while (count < 0) {
+		int32 previous = atomic_test_and_set(&gate->count, count + 1, count);
+		if (previous == count)
+			return status;
+		count = previous;
+	}
+
+	acquire_sem(gate->sem);
+	return B_OK;
+}
+
+static void
+gst_haikuaudio_sink_gate_release (GstHaikuAudioSinkGate *gate, uint32 flags)
+{
+	if (atomic_add(&gate->count, 1) < 0)
+		release_sem_etc(gate->sem, 1, flags);
+}
+
+/* Only called when nobody waits on the gate. */
+static void
+gst_haikuaudio_sink_gate_reset (GstHaikuAudioSinkGate *gate, int32 count)
+{
+	int32 pending;
+
+	if (get_sem_count(gate->sem, &pending) == B_OK && pending > 0)
+		acquire_sem_etc(gate->sem, pending, B_RELATIVE_TIMEOUT, 0);
+
+	atomic_set(&gate->count, count);
+}
+
+static void
+gst_haikuaudio_sink_sync_join (GstHaikuAudioSink * sink)
+{
+	if (sink->syncGroup != NULL)
+		return;
+
+	GST_OBJECT_LOCK (sink);
+	gchar *name = g_strdup (sink->syncGroupName);
+	GST_OBJECT_UNLOCK (sink);
+
+	if (name == NULL)
+		return;
+
+	g_mutex_lock (&sync_groups_lock);
+	if (sync_groups == NULL)
+		sync_groups = g_hash_table_new (g_str_hash, g_str_equal);
+
+	GstHaikuAudioSinkSyncGroup *group =
+		(GstHaikuAudioSinkSyncGroup*)g_hash_table_lookup (sync_groups, name);
+	if (group == NULL) {
+		group = g_new0 (GstHaikuAudioSinkSyncGroup, 1);
+		group->name = name;
+		name = NULL;
+		g_hash_table_insert (sync_groups, group->name, group);
+	}
+	group->members = g_list_prepend (group->members, sink);
+
+	sink->syncGroup = group;
+	atomic_set64(&sink->syncStart, 0);
+	sink->syncStarted = FALSE;
+	g_mutex_unlock (&sync_groups_lock);
+
+	g_free (name);
+}
+
+static void
+gst_haikuaudio_sink_sync_leave (GstHaikuAudioSink * sink)
+{
+	if (sink->syncGroup == NULL)
+		return;
+
+	g_mutex_lock (&sync_groups_lock);
+	GstHaikuAudioSinkSyncGroup *group = sink->syncGroup;
+	group->members = g_list_remove (group->members, sink);
+	if (atomic_get64(&sink->syncStart) != 0 && --group->armed == 0)
+		group->startTime = 0;
+	if (group->members == NULL) {
+		g_hash_table_remove (sync_groups, group->name);
+		g_free (group->name);
+		g_free (group);
+	}
+	sink->syncGroup = NULL;
+	atomic_set64(&sink->syncStart, 0);
+	sink->syncStarted = FALSE;
+	g_mutex_unlock (&sync_groups_lock);
+}
+
+/* Called by write() with the first segment of real data after the player
+ * started. The first member to get here picks the group's start time,
+ * leaving the others SYNC_GROUP_LEAD to catch up; it is picked again once
+ * every armed member has stopped its player. */
+static void
+gst_haikuaudio_sink_sync_arm (GstHaikuAudioSink * sink)
+{
+	g_mutex_lock (&sync_groups_lock);
+	GstHaikuAudioSinkSyncGroup *group = sink->syncGroup;
+	if (group != NULL && atomic_get64(&sink->syncStart) == 0) {
+		if (group->startTime == 0)
+			group->startTime = system_time() + sink->playerLatency + SYNC_GROUP_LEAD;
+		group->armed++;
+		atomic_set64(&sink->syncStart, group->startTime);
+	}
+	g_mutex_unlock (&sync_groups_lock);
+}
+
+/* Copies whole vectors of samples and folds them into the accumulators.
+ * With one or two channels, lane i of a vector always holds channel
+ * i % channels. Returns how many samples were handled; the caller does
+ * the rest. */
+template<typename T>
+static inline size_t
+gst_haikuaudio_sink_meter_vector (const T *in, T *out, size_t samples, uint32 channels,
+	float scale, float *peak, float *sum)
+{
+	return 0;
+}
+
+#ifdef __SSE2__
+static inline void
+gst_haikuaudio_sink_meter_fold (__m128 sumVector, __m128 peakVector, uint32 channels,
+	float *peak, float *sum)
+{
+	float lanes[4];
+	_mm_storeu_ps(lanes, sumVector);
+	for (uint32 i = 0; i < 4; i++)
+		sum[i % channels] += lanes[i];
+	_mm_storeu_ps(lanes, peakVector);
+	for (uint32 i = 0; i < 4; i++)
+		peak[i % channels] = MAX(peak[i % channels], lanes[i]);
+}
+
+template<>
+inline size_t
+gst_haikuaudio_sink_meter_vector<float> (const float *in, float *out, size_t samples, uint32 channels,
+	float scale, float *peak, float *sum)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 sumVector = _mm_setzero_ps();
+	__m128 peakVector = _mm_setzero_ps();
+	size_t done = samples & ~(size_t)3;
+
+	for (size_t i = 0; i < done; i += 4) {
+		__m128 value = _mm_loadu_ps(in + i);
+		_mm_storeu_ps(out + i, value);
+		sumVector = _mm_add_ps(sumVector, _mm_mul_ps(value, value));
+		peakVector = _mm_max_ps(peakVector, _mm_and_ps(value, absMask));
+	}
+
+	gst_haikuaudio_sink_meter_fold(sumVector, peakVector, channels, peak, sum);
+	return done;
+}
+
+template<>
+inline size_t
+gst_haikuaudio_sink_meter_vector<int16> (const int16 *in, int16 *out, size_t samples, uint32 channels,
+	float scale, float *peak, float *sum)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 scaleVector = _mm_set1_ps(scale);
+	__m128 sumVector = _mm_setzero_ps();
+	__m128 peakVector = _mm_setzero_ps();
+	size_t done = samples & ~(size_t)7;
+
+	for (size_t i = 0; i < done; i += 8) {
+		__m128i value = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_si128((__m128i*)(out + i), value);
+		/* sign-extend to 32 bit; both halves keep the lane to channel mapping */
+		__m128 low = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(value, value), 16)), scaleVector);
+		__m128 high = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(value, value), 16)), scaleVector);
+		sumVector = _mm_add_ps(sumVector, _mm_add_ps(_mm_mul_ps(low, low), _mm_mul_ps(high, high)));
+		peakVector = _mm_max_ps(peakVector, _mm_max_ps(_mm_and_ps(low, absMask), _mm_and_ps(high, absMask)));
+	}
+
+	gst_haikuaudio_sink_meter_fold(sumVector, peakVector, channels, peak, sum);
+	return done;
+}
+#endif
+
+/* Copies interleaved frames and folds them into the running per-channel
+ * peak and sum of squares, normalized to [-1, 1]. Each frame is read once;
+ * the channel count is a template argument so the per-frame loop is fully
+ * unrolled and the accumulators stay in registers. */
+template<typename T, uint32 C>
+static void
+gst_haikuaudio_sink_copy_meter_frames (GstHaikuAudioSink * sink, guint8 *dest, const guint8 *src,
+	size_t frames, float bias, float scale)
+{
+	const T *in = (const T*)src;
+	T *out = (T*)dest;
+	float peak[C];
+	float sum[C];
+
+	for (uint32 c = 0; c < C; c++) {
+		peak[c] = sink->levelPeak[c];
+		sum[c] = 0.0f;
+	}
+
+	size_t samples = frames * C;
+	size_t i = gst_haikuaudio_sink_meter_vector<T>(in, out, samples, C, scale, peak, sum);
+	for (; i < samples; i += C) {
+		for (uint32 c = 0; c < C; c++) {
+			T value = in[i + c];
+			out[i + c] = value;
+			float sample = ((float)value - bias) * scale;
+			sum[c] += sample * sample;
+			peak[c] = MAX(peak[c], fabsf(sample));
+		}
+	}
+
+	for (uint32 c = 0; c < C; c++) {
+		sink->levelPeak[c] = peak[c];
+		sink->levelSum[c] += sum[c];
+	}
+	sink->levelFrames += frames;
+}
+
+template<typename T>
+static void
+gst_haikuaudio_sink_copy_meter_samples (GstHaikuAudioSink * sink, guint8 *dest, const guint8 *src,
+	size_t length, uint32 channels, float bias, float scale)
+{
+	size_t frames = length / (channels * sizeof(T));
+
+	if (channels == 2)
+		gst_haikuaudio_sink_copy_meter_frames<T, 2>(sink, dest, src, frames, bias, scale);
+	else
+		gst_haikuaudio_sink_copy_meter_frames<T, 1>(sink, dest, src, frames, bias, scale);
+}
+
+/* Meters data in the player's format; dest may equal src. */
+static void
+gst_haikuaudio_sink_copy_meter (GstHaikuAudioSink * sink, guint8 *dest, const guint8 *src, size_t length)
+{
+	uint32 channels = sink->playerFormat.channel_count;
+
+	switch (sink->playerFormat.format) {
+		case media_raw_audio_format::B_AUDIO_CHAR:
+			gst_haikuaudio_sink_copy_meter_samples<int8>(sink, dest, src, length, channels, 0.0f, 1.0f / 128);
+			break;
+		case media_raw_audio_format::B_AUDIO_UCHAR:
+			gst_haikuaudio_sink_copy_meter_samples<uint8>(sink, dest, src, length, channels, 128.0f, 1.0f / 128);
+			break;
+		case media_raw_audio_format::B_AUDIO_SHORT:
+			gst_haikuaudio_sink_copy_meter_samples<int16>(sink, dest, src, length, channels, 0.0f, 1.0f / 32768);
+			break;
+		case media_raw_audio_format::B_AUDIO_INT:
+			gst_haikuaudio_sink_copy_meter_samples<int32>(sink, dest, src, length, channels, 0.0f, 1.0f / 2147483648.0f);
+			break;
+		case media_raw_audio_format::B_AUDIO_FLOAT:
+			gst_haikuaudio_sink_copy_meter_samples<float>(sink, dest, src, length, channels, 0.0f, 1.0f);
+			break;
+		default:
+			memcpy(dest, src, length);
+			break;
+	}
+}
+
+static void
+gst_haikuaudio_sink_level_reset (GstHaikuAudioSink * sink)
+{
+	for (int c = 0; c < GST_HAIKUAUDIOSINK_MAX_CHANNELS; c++) {
+		sink->levelPeak[c] = 0.0f;
+		sink->levelSum[c] = 0.0;
+	}
+	sink->levelFrames = 0;
+}
+
+/* Called from the callback once an interval worth of frames was metered.
+ * end is the system time at which the last of them is played. */
+static void
+gst_haikuaudio_sink_level_publish (GstHaikuAudioSink * sink, bigtime_t end)
+{
+	GstClockTime duration = gst_util_uint64_scale_int (sink->levelFrames, GST_SECOND,
+		(gint)sink->playerFormat.frame_rate);
+
+	atomic_add(&sink->levelSeq, 1);
+	for (int c = 0; c < GST_HAIKUAUDIOSINK_MAX_CHANNELS; c++) {
+		sink->levelPeakOut[c] = sink->levelPeak[c];
+		sink->levelRmsOut[c] = (float)sqrt(sink->levelSum[c] / sink->levelFrames);
+	}
+	sink->levelDurationOut = duration;
+	sink->levelChannelsOut = MIN(sink->playerFormat.channel_count, GST_HAIKUAUDIOSINK_MAX_CHANNELS);
+	sink->levelEndOut = end;
+	atomic_add(&sink->levelSeq, 1);
+
+	gst_haikuaudio_sink_level_reset(sink);
+}
+
+static gdouble
+gst_haikuaudio_sink_level_db (float value)
+{
+	return value > 0.0f ? 20.0 * log10(value) : -G_MAXDOUBLE;
+}
+
+/* Called from write(): posts the last published levels, at most once per
+ * interval, in the layout of the level element's messages. The interval
+ * is placed on the running time by when its last frame is played, and
+ * the decay falls off by LEVEL_PEAK_FALLOFF dB per second. */
+static void
+gst_haikuaudio_sink_level_post (GstHaikuAudioSink * sink)
+{
+	int32 seq = atomic_get(&sink->levelSeq);
+	if (seq == sink->levelPosted || (seq & 1) != 0)
+		return;
+
+	float peak[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	float rms[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	memcpy(peak, sink->levelPeakOut, sizeof(peak));
+	memcpy(rms, sink->levelRmsOut, sizeof(rms));
+	GstClockTime duration = sink->levelDurationOut;
+	guint channels = sink->levelChannelsOut;
+	bigtime_t end = sink->levelEndOut;
+	if (atomic_get(&sink->levelSeq) != seq)
+		return;
+	sink->levelPosted = seq;
+
+	GstClockTime runningTime = GST_CLOCK_TIME_NONE;
+	GstClockTime timestamp = GST_CLOCK_TIME_NONE;
+	GstClockTime streamTime = GST_CLOCK_TIME_NONE;
+	GstClockTime endTime = GST_CLOCK_TIME_NONE;
+
+	GstClockTime now = gst_element_get_current_running_time (GST_ELEMENT (sink));
+	if (GST_CLOCK_TIME_IS_VALID (now)) {
+		GstClockTimeDiff ahead = (end - system_time()) * GST_USECOND;
+		if ((GstClockTimeDiff)now + ahead >= (GstClockTimeDiff)duration)
+			runningTime = now + ahead - duration;
+	}
+	if (GST_CLOCK_TIME_IS_VALID (runningTime)) {
+		GST_OBJECT_LOCK (sink);
+		GstSegment *segment = &GST_BASE_SINK (sink)->segment;
+		timestamp = gst_segment_position_from_running_time (segment, GST_FORMAT_TIME, runningTime);
+		if (GST_CLOCK_TIME_IS_VALID (timestamp)) {
+			streamTime = gst_segment_to_stream_time (segment, GST_FORMAT_TIME, timestamp);
+			endTime = timestamp + duration;
+		}
+		GST_OBJECT_UNLOCK (sink);
+	}
+
+	gdouble falloff = LEVEL_PEAK_FALLOFF * duration / GST_SECOND;
+	GValue value = G_VALUE_INIT;
+	g_value_init (&value, G_TYPE_DOUBLE);
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	GValueArray *peakArray = g_value_array_new (channels);
+	GValueArray *rmsArray = g_value_array_new (channels);
+	GValueArray *decayArray = g_value_array_new (channels);
+	for (guint c = 0; c < channels; c++) {
+		gdouble peakDb = gst_haikuaudio_sink_level_db(peak[c]);
+		sink->levelDecay[c] = MAX(peakDb, sink->levelDecay[c] - falloff);
+
+		g_value_set_double (&value, peakDb);
+		g_value_array_append (peakArray, &value);
+		g_value_set_double (&value, gst_haikuaudio_sink_level_db(rms[c]));
+		g_value_array_append (rmsArray, &value);
+		g_value_set_double (&value, sink->levelDecay[c]);
+		g_value_array_append (decayArray, &value);
+	}
+
+	GstStructure *structure = gst_structure_new ("level",
+		"endtime", GST_TYPE_CLOCK_TIME, endTime,
+		"timestamp", G_TYPE_UINT64, timestamp,
+		"stream-time", G_TYPE_UINT64, streamTime,
+		"running-time", G_TYPE_UINT64, runningTime,
+		"duration", G_TYPE_UINT64, duration,
+		"rms", G_TYPE_VALUE_ARRAY, rmsArray,
+		"peak", G_TYPE_VALUE_ARRAY, peakArray,
+		"decay", G_TYPE_VALUE_ARRAY, decayArray,
+		NULL);
+
+	g_value_array_free (peakArray);
+	g_value_array_free (rmsArray);
+	g_value_array_free (decayArray);
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+	g_value_unset (&value);
+
+	gst_element_post_message (GST_ELEMENT (sink), gst_message_new_element (GST_OBJECT (sink), structure));
+}
+
+/* Copies length bytes of queued segments to dest, or drops them when dest
+ * is NULL, waiting for the writer until deadline. A segment that is only
+ * partly consumed stays held until a later call takes the rest. */
+static size_t
+gst_haikuaudio_sink_fill (GstHaikuAudioSink * sink, guint8 *dest, size_t length,
+	bigtime_t deadline, bigtime_t *wait)
+{
+	size_t done = 0;
+
+	while (done < length) {
+		if (!sink->holding) {
+			bigtime_t before = system_time();
+			status_t status = gst_haikuaudio_sink_gate_acquire(&sink->blockGate, deadline,
+				&sink->statCallbackFast, &sink->statCallbackSlow);
+			bigtime_t after = system_time();
+			*wait += after - before;
+			if (status != B_OK)
+				break;
+
+			atomic_add64(&sink->statLatencyHist[gst_haikuaudio_sink_latency_bucket(after - sink->segmentTime)], 1);
+			sink->readOffset = 0;
+			sink->holding = TRUE;
+		}
+
+		size_t chunk = MIN(length - done, sink->segmentLength - sink->readOffset);
+		if (dest != NULL && sink->converter == NULL && atomic_get64(&sink->levelInterval) > 0)
+			gst_haikuaudio_sink_copy_meter(sink, dest + done, sink->buffer + sink->readOffset, chunk);
+		else if (dest != NULL)
+			memcpy(dest + done, sink->buffer + sink->readOffset, chunk);
+		sink->readOffset += chunk;
+		done += chunk;
+
+		if (sink->readOffset == sink->segmentLength) {
+			sink->holding = FALSE;
+			gst_haikuaudio_sink_gate_release(&sink->unblockGate, B_DO_NOT_RESCHEDULE);
+		}
+	}
+
+	return done;
+}
+
+/* Lines the first frame of the stream up with the group start time.
+ * Returns how many bytes of silence go in front of the stream in this
+ * callback; a late sink drops up to one segment instead. */
+static size_t
+gst_haikuaudio_sink_sync_align (GstHaikuAudioSink * sink, size_t length, bigtime_t now,
+	bigtime_t deadline, bigtime_t *wait)
+{
+	float rate = sink->mediaKitFormat.frame_rate;
+	bigtime_t playout = now + sink->playerLatency;
+	int64 frames = (int64)((sink->syncStart - playout) * rate / G_USEC_PER_SEC);
+
+	if (frames >= (int64)(length / sink->bytesPerFrame))
+		return length;
+
+	size_t pad = 0;
+	if (frames >= 0) {
+		pad = frames * sink->bytesPerFrame;
+	} else {
+		size_t late = MIN((size_t)-frames * sink->bytesPerFrame, (size_t)sink->mediaKitFormat.buffer_size);
+		frames = -(int64)(gst_haikuaudio_sink_fill(sink, NULL, late, deadline, wait) / sink->bytesPerFrame);
+	}
+
+	/* where the first stream frame actually lands relative to the group start */
+	bigtime_t offset = playout + (bigtime_t)(frames * G_USEC_PER_SEC / rate) - sink->syncStart;
+	atomic_set64(&sink->statSyncOffset, offset);
+	sink->syncStarted = TRUE;
+
+	return pad;
+}
+
 static void
 gst_haikuaudio_sink_soundplayer_callback(void *cookie, void *buffer, size_t length, const media_raw_audio_format &format)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK ((GstAudioSink*)cookie);
 
-	if (acquire_sem_etc(haikuaudio->block_sem, 1, B_RELATIVE_TIMEOUT, haikuaudio->latency_time) == B_TIMED_OUT) {
+	if (!g_mutex_trylock (&haikuaudio->configLock)) {
 		memset(buffer, 0, length);
 		return;
 	}
 
-	memcpy(buffer, haikuaudio->buffer, length);
-	release_sem(haikuaudio->unblock_sem);
+	thread_id thread = find_thread(NULL);
+	if (thread != haikuaudio->callbackThread) {
+		atomic_set64(&haikuaudio->callbackCpuBase, gst_haikuaudio_sink_thread_cpu(thread));
+		atomic_set(&haikuaudio->callbackThread, thread);
+	}
+
+	bigtime_t now = system_time();
+	gboolean streaming = atomic_get(&haikuaudio->streaming) != 0;
+	int32 queued = atomic_get(&haikuaudio->blockGate.count);
+	if (haikuaudio->lastCallbackTime > 0) {
+		int64 jitter = (now - haikuaudio->lastCallbackTime) - haikuaudio->latency_time;
+		if (jitter < 0)
+			jitter = -jitter;
+		atomic_add64(&haikuaudio->statJitterSum, jitter);
+		if (jitter > atomic_get64(&haikuaudio->statJitterMax))
+			atomic_set64(&haikuaudio->statJitterMax, jitter);
+	}
+	haikuaudio->lastCallbackTime = now;
+	atomic_add64(&haikuaudio->statCallbacks, 1);
+
+	bigtime_t deadline = now + haikuaudio->latency_time;
+	bigtime_t wait = 0;
+	size_t pad = 0;
+	uint32 flags = 0;
+
+	size_t copied;
+
+	if (haikuaudio->converter != NULL) {
+		/* the player kept its old format, bring the stream to it */
+		gsize outFrames = length / haikuaudio->playerBytesPerFrame;
+		gsize inFrames = MIN(gst_audio_converter_get_in_frames(haikuaudio->converter, outFrames),
+			haikuaudio->convertBufferSize / haikuaudio->bytesPerFrame);
+		size_t wanted = inFrames * haikuaudio->bytesPerFrame;
+
+		copied = gst_haikuaudio_sink_fill(haikuaudio, haikuaudio->convertBuffer, wanted, deadline, &wait);
+		if (copied < wanted) {
+			memset(haikuaudio->convertBuffer + copied, 0, wanted - copied);
+			if (streaming) {
+				atomic_add64(&haikuaudio->statUnderruns, 1);
+				flags |= GST_HAIKUAUDIOSINK_RECORD_TIMEOUT;
+			}
+		}
+
+		gpointer in[1] = { haikuaudio->convertBuffer };
+		gpointer out[1] = { buffer };
+		if (!gst_audio_converter_samples(haikuaudio->converter, GST_AUDIO_CONVERTER_FLAG_NONE,
+				in, inFrames, out, outFrames))
+			memset(buffer, 0, length);
+		else if (atomic_get64(&haikuaudio->levelInterval) > 0)
+			gst_haikuaudio_sink_copy_meter(haikuaudio, (guint8*)buffer, (const guint8*)buffer, length);
+	} else {
+		if (haikuaudio->syncGroup != NULL && !haikuaudio->syncStarted && atomic_get64(&haikuaudio->syncStart) != 0)
+			pad = gst_haikuaudio_sink_sync_align(haikuaudio, length, now, deadline, &wait);
+		memset(buffer, 0, pad);
+
+		copied = gst_haikuaudio_sink_fill(haikuaudio, (guint8*)buffer + pad, length - pad, deadline, &wait);
+		if (copied < length - pad) {
+			memset((guint8*)buffer + pad + copied, 0, length - pad - copied);
+			if (streaming) {
+				atomic_add64(&haikuaudio->statUnderruns, 1);
+				flags |= GST_HAIKUAUDIOSINK_RECORD_TIMEOUT;
+			}
+		}
+	}
+
+	if (!streaming)
+		flags |= GST_HAIKUAUDIOSINK_RECORD_PAUSED;
+	gst_haikuaudio_sink_recorder_append(haikuaudio, buffer, length, now, wait, flags, queued);
+
+	/* starved for idle-timeout: stop being pulled until write() has audio.
+	 * SetHasData() needs playerLock, so the monitor does it. */
+	bigtime_t idleTimeout = atomic_get64(&haikuaudio->idleTimeout) / GST_USECOND;
+	if ((flags & GST_HAIKUAUDIOSINK_RECORD_TIMEOUT) == 0) {
+		haikuaudio->starvedSince = 0;
+	} else if (haikuaudio->starvedSince == 0) {
+		haikuaudio->starvedSince = now;
+	} else if (idleTimeout > 0 && now - haikuaudio->starvedSince >= idleTimeout) {
+		haikuaudio->starvedSince = 0;
+		if (atomic_get_and_set(&haikuaudio->idleRequest, 1) == 0)
+			release_sem_etc(haikuaudio->monitorSem, 1, B_DO_NOT_RESCHEDULE);
+	}
+
+	uint32 playerBytesPerFrame = haikuaudio->converter != NULL ?
+		haikuaudio->playerBytesPerFrame : haikuaudio->bytesPerFrame;
+	bigtime_t playout = (bigtime_t)(length / playerBytesPerFrame * G_USEC_PER_SEC / haikuaudio->playerFormat.frame_rate);
+
+	int64 levelInterval = atomic_get64(&haikuaudio->levelInterval);
+	if (levelInterval > 0 && haikuaudio->levelFrames > 0 &&
+		haikuaudio->levelFrames >= levelInterval * haikuaudio->playerFormat.frame_rate / GST_SECOND)
+		gst_haikuaudio_sink_level_publish(haikuaudio, now + haikuaudio->playerLatency + playout);
+
+	/* playout time the player asked for against stream time delivered;
+	 * the difference grows with every frame of inserted silence. Silence
+	 * played while the ring buffer is paused is not drift. */
+	if (streaming) {
+		atomic_add64(&haikuaudio->statPlayoutTime, playout);
+		atomic_add64(&haikuaudio->statStreamTime,
+			(int64)(copied / haikuaudio->bytesPerFrame * G_USEC_PER_SEC / haikuaudio->mediaKitFormat.frame_rate));
+	}
+
+	atomic_add64(&haikuaudio->statFrames, copied / haikuaudio->bytesPerFrame);
+
+	g_mutex_unlock (&haikuaudio->configLock);
 }
 
+/* Puts the hand-off gates back to "buffer free, nothing queued". Only called
+ * while the player is stopped or configLock keeps the callback out, so
+ * nobody waits on them. */
+static void
+gst_haikuaudio_sink_reset_handoff (GstHaikuAudioSink * sink)
+{
+	gst_haikuaudio_sink_gate_reset(&sink->blockGate, 0);
+	gst_haikuaudio_sink_gate_reset(&sink->unblockGate, 1);
+
+	sink->readOffset = 0;
+	sink->holding = FALSE;
+}
+
+/* The caller holds playerLock. */
+static void
+gst_haikuaudio_sink_soundplayer_stop_locked (GstHaikuAudioSink * sink)
+{
+	if (sink->soundPlayer != NULL && sink->playerRunning) {
+		gst_haikuaudio_sink_get_volume (sink);
+
+		sink->soundPlayer->SetHasData(false);
+		sink->soundPlayer->Stop();
+
+		sink->playerRunning = FALSE;
+		gst_haikuaudio_sink_sync_leave(sink);
+	}
+}
+
+/* The caller holds playerLock. */
+static void
+gst_haikuaudio_sink_soundplayer_delete_locked (GstHaikuAudioSink * sink)
+{
+	if (sink->soundPlayer != NULL) {
+		gst_haikuaudio_sink_soundplayer_stop_locked(sink);
+		gst_haikuaudio_sink_callback_cpu_fold(sink);
+
+		delete sink->soundPlayer;
+
+		sink->soundPlayer = NULL;
+	}
+}
+
+/* The caller holds playerLock. Lets the existing player keep its format by
+ * converting the newly negotiated stream to it, or drops the converter when
+ * the formats match again. Returns FALSE when no conversion is possible. */
+static gboolean
+gst_haikuaudio_sink_converter_setup (GstHaikuAudioSink * sink)
+{
+	GstAudioConverter *converter = NULL;
+	guint32 size = 0;
+	GstAudioInfo playerInfo;
+
+	if (!(sink->playerFormat == sink->mediaKitFormat)) {
+		gst_audio_info_init (&playerInfo);
+		gst_audio_info_set_format (&playerInfo, gst_format_from_mediakit(sink->playerFormat.format),
+			(gint)sink->playerFormat.frame_rate, sink->playerFormat.channel_count, NULL);
+
+		converter = gst_audio_converter_new (GST_AUDIO_CONVERTER_FLAG_NONE, &sink->streamInfo, &playerInfo, NULL);
+		if (converter == NULL)
+			return FALSE;
+
+		/* the resampler may ask for a few frames more on some cycles */
+		gsize outFrames = sink->playerFormat.buffer_size / GST_AUDIO_INFO_BPF (&playerInfo);
+		gsize inFrames = gst_audio_converter_get_in_frames(converter, outFrames) + 16;
+		size = inFrames * sink->bytesPerFrame;
+
+		/* the converter sizes its work buffers on first use: run it once at
+		 * the largest period here so the callback never allocates */
+		gpointer in[1] = { g_malloc0 (size) };
+		gpointer out[1] = { g_malloc0 (sink->playerFormat.buffer_size) };
+		gst_audio_converter_samples(converter, GST_AUDIO_CONVERTER_FLAG_NONE,
+			in, gst_audio_converter_get_in_frames(converter, outFrames), out, outFrames);
+		gst_audio_converter_reset(converter);
+		g_free (in[0]);
+		g_free (out[0]);
+	}
+
+	g_mutex_lock (&sink->configLock);
+	GstAudioConverter *previous = sink->converter;
+	sink->converter = converter;
+	if (converter != NULL) {
+		sink->playerBytesPerFrame = GST_AUDIO_INFO_BPF (&playerInfo);
+		if (sink->convertBufferSize < size) {
+			g_free (sink->convertBuffer);
+			sink->convertBuffer = (guint8*)g_malloc (size);
+			sink->convertBufferSize = size;
+			atomic_add64(&sink->statAllocations, 1);
+		}
+	}
+	g_mutex_unlock (&sink->configLock);
+
+	if (previous != NULL)
+		gst_audio_converter_free (previous);
+
+	return TRUE;
+}
+
+/* Starts the player. A stopped one is reused when its format still matches,
+ * a running one is kept across a caps change and fed through a converter. */
 static void
 gst_haikuaudio_sink_soundplayer_create (GstHaikuAudioSink * sink)
 {
-	if(sink->soundPlayer == NULL) {
-		sink->soundPlayer = new BSoundPlayer(&sink->mediaKitFormat,
-			sink->nodeName->String(), gst_haikuaudio_sink_soundplayer_callback, NULL, (void*)sink);
+	g_rec_mutex_lock (&sink->playerLock);
+
+	GST_OBJECT_LOCK (sink);
+	gchar *device = g_strdup (sink->device);
+	GST_OBJECT_UNLOCK (sink);
+
+	if (sink->soundPlayer != NULL && (g_strcmp0 (sink->playerDevice, device) != 0 ||
+		(!sink->playerRunning && !(sink->playerFormat == sink->mediaKitFormat)) ||
+		!gst_haikuaudio_sink_converter_setup(sink)))
+		gst_haikuaudio_sink_soundplayer_delete_locked(sink);
+
+	if (sink->soundPlayer == NULL) {
+		media_node node;
+		if (device != NULL && gst_haikuaudio_device_lookup(device, &node)) {
+			media_multi_audio_format format = media_multi_audio_format::wildcard;
+			format.frame_rate = sink->mediaKitFormat.frame_rate;
+			format.channel_count = sink->mediaKitFormat.channel_count;
+			format.format = sink->mediaKitFormat.format;
+			format.byte_order = sink->mediaKitFormat.byte_order;
+			format.buffer_size = sink->mediaKitFormat.buffer_size;
+			sink->soundPlayer = new BSoundPlayer(node, &format, sink->nodeName->String(),
+				NULL, gst_haikuaudio_sink_soundplayer_callback, NULL, (void*)sink);
+		} else {
+			sink->soundPlayer = new BSoundPlayer(&sink->mediaKitFormat,
+				sink->nodeName->String(), gst_haikuaudio_sink_soundplayer_callback, NULL, (void*)sink);
+		}
 
 		if(sink->soundPlayer->InitCheck() != B_OK) {
 			delete sink->soundPlayer;
 			sink->soundPlayer = NULL;
+			g_rec_mutex_unlock (&sink->playerLock);
+			g_free (device);
 			return;
 		}
 
-		sink->block_sem = create_sem(0, "blocker");
-		sink->unblock_sem = create_sem(1, "unblocker");
+		sink->playerFormat = sink->mediaKitFormat;
+		gst_haikuaudio_sink_converter_setup(sink);
+		g_free (sink->playerDevice);
+		sink->playerDevice = device;
+		device = NULL;
+		atomic_add64(&sink->statPlayers, 1);
+	}
+
+	/* the recorder keeps what the player gets, in the player's format */
+	g_mutex_lock (&sink->configLock);
+	gst_haikuaudio_sink_recorder_create(sink);
+	g_mutex_unlock (&sink->configLock);
+
+	if (!sink->playerRunning) {
+		gst_haikuaudio_sink_reset_handoff(sink);
+
+		sink->lastCallbackTime = 0;
+		sink->playerLatency = sink->soundPlayer->Latency();
+		gst_haikuaudio_sink_sync_join(sink);
 
 		sink->soundPlayer->Start();
 		sink->soundPlayer->SetHasData(true);
+		sink->playerRunning = TRUE;
+		atomic_set(&sink->idle, 0);
 
 		gst_haikuaudio_sink_set_volume (sink, gst_haikuaudio_sink_get_volume (sink), FALSE);
 		gst_haikuaudio_sink_set_mute (sink, sink->mute);
 	}
+
+	g_rec_mutex_unlock (&sink->playerLock);
+	g_free (device);
+}
+
+static void
+gst_haikuaudio_sink_soundplayer_stop (GstHaikuAudioSink * sink)
+{
+	g_rec_mutex_lock (&sink->playerLock);
+	gst_haikuaudio_sink_soundplayer_stop_locked(sink);
+	g_rec_mutex_unlock (&sink->playerLock);
 }
 
 static void
 gst_haikuaudio_sink_soundplayer_delete (GstHaikuAudioSink * sink)
 {
-	if (sink->soundPlayer != NULL) {
-		gst_haikuaudio_sink_get_volume (sink);
+	g_rec_mutex_lock (&sink->playerLock);
+	gst_haikuaudio_sink_soundplayer_delete_locked(sink);
+	g_rec_mutex_unlock (&sink->playerLock);
+}
 
-		sink->soundPlayer->SetHasData(false);
-		sink->soundPlayer->Stop();
+/* Stops a player nobody streams to any more and, for web apps, deletes it
+ * once writes stop. A player fed through a converter is deleted rather
+ * than stopped so the next start opens it in the stream's own format.
+ * Returns when it wants to look again. */
+static bigtime_t
+gst_haikuaudio_sink_monitor_check (GstHaikuAudioSink * sink)
+{
+	bigtime_t now = system_time();
+	bigtime_t deadline = B_INFINITE_TIMEOUT;
+
+	g_rec_mutex_lock (&sink->playerLock);
+
+	bigtime_t stopped = atomic_get64(&sink->stoppedSince);
+	if (sink->playerRunning && atomic_get(&sink->streaming) == 0 && stopped != 0) {
+		if (now - stopped < PLAYER_LINGER)
+			deadline = stopped + PLAYER_LINGER;
+		else if (sink->converter != NULL || sink->is_webapp)
+			gst_haikuaudio_sink_soundplayer_delete_locked(sink);
+		else
+			gst_haikuaudio_sink_soundplayer_stop_locked(sink);
+	}
 
-		delete_sem(sink->block_sem);
-		delete_sem(sink->unblock_sem);
+	if (atomic_get(&sink->monitorActive) != 0 && sink->soundPlayer != NULL) {
+		if (now - sink->lastWriteTime > WEBAPP_LINGER)
+			gst_haikuaudio_sink_soundplayer_delete_locked(sink);
+		else
+			deadline = MIN(deadline, sink->lastWriteTime + WEBAPP_LINGER);
+	}
 
-		delete sink->soundPlayer;
+	g_rec_mutex_unlock (&sink->playerLock);
 
-		sink->soundPlayer = NULL;
-	}
+	return deadline;
 }
 
+/* Lives as long as the sink and is told to quit by finalize instead of
+ * being killed. It writes flight recorder dumps requested by the callback
+ * and runs monitor_check; between deadlines it sleeps on monitorSem, which
+ * is released whenever streaming stops. */
 static int32
 gst_haikuaudio_sink_monitor_thread (void *data)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK ((GstAudioSink*)data);
-	while(true) {
-		if (system_time() - haikuaudio->lastWriteTime > G_USEC_PER_SEC && haikuaudio->soundPlayer != NULL)
-			gst_haikuaudio_sink_soundplayer_delete(haikuaudio);
-		snooze(G_USEC_PER_SEC / 100);
+	bigtime_t deadline = B_INFINITE_TIMEOUT;
+
+	while (atomic_get(&haikuaudio->monitorQuit) == 0) {
+		if (deadline == B_INFINITE_TIMEOUT)
+			acquire_sem(haikuaudio->monitorSem);
+		else
+			acquire_sem_etc(haikuaudio->monitorSem, 1, B_ABSOLUTE_TIMEOUT, deadline);
+
+		if (atomic_get_and_set(&haikuaudio->recorderDumpPending, 0) != 0)
+			gst_haikuaudio_sink_recorder_dump(haikuaudio);
+
+		if (atomic_get_and_set(&haikuaudio->idleRequest, 0) != 0)
+			gst_haikuaudio_sink_idle_set(haikuaudio, TRUE);
+
+		deadline = gst_haikuaudio_sink_monitor_check(haikuaudio);
 	}
+
+	if (atomic_get_and_set(&haikuaudio->recorderDumpPending, 0) != 0)
+		gst_haikuaudio_sink_recorder_dump(haikuaudio);
+
+	return 0;
 }
 
 static gboolean
@@ -389,27 +1776,145 @@ gst_haikuaudio_sink_close (GstAudioSink * asink)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
+	gst_haikuaudio_sink_soundplayer_stop(haikuaudio);
+
 	return TRUE;
 }
 
+/* Re-reads the player latency at most once per LATENCY_CHECK_INTERVAL and
+ * asks the pipeline to redistribute latency when it moved noticeably. */
+static void
+gst_haikuaudio_sink_latency_update (GstHaikuAudioSink * sink, gboolean force)
+{
+	bigtime_t now = system_time();
+	if (!force && now - sink->latencyCheckTime < LATENCY_CHECK_INTERVAL)
+		return;
+	sink->latencyCheckTime = now;
+
+	g_rec_mutex_lock (&sink->playerLock);
+	if (sink->soundPlayer != NULL)
+		sink->playerLatency = sink->soundPlayer->Latency();
+	g_rec_mutex_unlock (&sink->playerLock);
+
+	int64 latency = sink->playerLatency + sink->latency_time;
+	int64 reported = atomic_get_and_set64(&sink->reportedLatency, latency);
+
+	if (reported != 0 && ABS(latency - reported) > LATENCY_CHANGE_LIMIT)
+		gst_element_post_message (GST_ELEMENT (sink), gst_message_new_latency (GST_OBJECT (sink)));
+}
+
+/* Returns TRUE when the segment holds digital silence. Real audio almost
+ * always fails on the first word, so only silent segments are scanned whole. */
+static gboolean
+gst_haikuaudio_sink_is_silent (GstHaikuAudioSink * sink, const guint8 *data, guint length)
+{
+	uint64 silence = sink->mediaKitFormat.format == media_raw_audio_format::B_AUDIO_UCHAR ?
+		G_GUINT64_CONSTANT(0x8080808080808080) : 0;
+	guint words = length / sizeof(uint64);
+
+	for (guint i = 0; i < words; i++) {
+		uint64 word;
+		memcpy(&word, data + i * sizeof(uint64), sizeof(word));
+		if (word != silence)
+			return FALSE;
+	}
+	for (guint i = words * sizeof(uint64); i < length; i++) {
+		if (data[i] != (guint8)silence)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+gst_haikuaudio_sink_idle_set (GstHaikuAudioSink * sink, gboolean idle)
+{
+	g_rec_mutex_lock (&sink->playerLock);
+	if (sink->soundPlayer != NULL && sink->playerRunning)
+		sink->soundPlayer->SetHasData(!idle);
+	if (idle && atomic_get_and_set(&sink->idle, 1) == 0)
+		atomic_add64(&sink->statIdleEntries, 1);
+	else if (!idle)
+		atomic_set(&sink->idle, 0);
+	g_rec_mutex_unlock (&sink->playerLock);
+}
+
 static gint
 gst_haikuaudio_sink_write (GstAudioSink * asink, gpointer data, guint length)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	if (haikuaudio->is_webapp && haikuaudio->soundPlayer == NULL)
+	/* the ring buffer calls resume only when leaving PAUSED; a start from
+	 * STOPPED just wakes this thread, so write() marks it started */
+	if (atomic_get(&haikuaudio->streaming) == 0) {
+		atomic_set64(&haikuaudio->stoppedSince, 0);
+		atomic_set(&haikuaudio->streaming, 1);
+	}
+
+	/* the monitor stops the player after a while in PAUSED, and deletes
+	 * web app players once writes stop */
+	if (!haikuaudio->playerRunning) {
 		gst_haikuaudio_sink_soundplayer_create(haikuaudio);
+		gst_haikuaudio_sink_latency_update(haikuaudio, TRUE);
+	}
 
+	if (atomic_get64(&haikuaudio->levelInterval) > 0)
+		gst_haikuaudio_sink_level_post(haikuaudio);
+
+	gst_haikuaudio_sink_latency_update(haikuaudio, FALSE);
+
+	/* the ring buffer thread hands over one segment per call; should it
+	 * ever pass more, the rest comes back on the next call. Batching here
+	 * saves nothing, GstAudioSink still wakes this thread once per period.
+	 * Dropping that wake-up needs the player callback to read the
+	 * GstAudioRingBuffer segments itself through create_ringbuffer. */
 	if (length > haikuaudio->mediaKitFormat.buffer_size) {
 		length = haikuaudio->mediaKitFormat.buffer_size;
 	}
 
-	if (acquire_sem_etc(haikuaudio->unblock_sem, 1, B_RELATIVE_TIMEOUT, haikuaudio->latency_time) == B_TIMED_OUT)
+	bigtime_t idleTimeout = atomic_get64(&haikuaudio->idleTimeout) / GST_USECOND;
+	if (idleTimeout > 0 && gst_haikuaudio_sink_is_silent(haikuaudio, (const guint8*)data, length)) {
+		bigtime_t now = system_time();
+		if (haikuaudio->silentSince == 0)
+			haikuaudio->silentSince = now;
+		if (atomic_get(&haikuaudio->idle) == 0 && now - haikuaudio->silentSince >= idleTimeout) {
+			gst_haikuaudio_sink_idle_set(haikuaudio, TRUE);
+			haikuaudio->idleDeadline = now;
+		}
+		if (atomic_get(&haikuaudio->idle) != 0) {
+			/* drop the silence but keep the pace, the ring buffer clock
+			 * advances with every segment we accept */
+			haikuaudio->idleDeadline = MAX(haikuaudio->idleDeadline, now - haikuaudio->latency_time) +
+				(bigtime_t)(length / haikuaudio->bytesPerFrame * G_USEC_PER_SEC / haikuaudio->mediaKitFormat.frame_rate);
+			snooze_until(haikuaudio->idleDeadline, B_SYSTEM_TIMEBASE);
+			haikuaudio->lastWriteTime = system_time();
+			return length;
+		}
+	} else {
+		/* sound, or idle-timeout turned off while idle: the player has to
+		 * come back either way */
+		haikuaudio->silentSince = 0;
+		if (atomic_get(&haikuaudio->idle) != 0)
+			gst_haikuaudio_sink_idle_set(haikuaudio, FALSE);
+	}
+
+	if (haikuaudio->syncGroup != NULL && atomic_get64(&haikuaudio->syncStart) == 0)
+		gst_haikuaudio_sink_sync_arm(haikuaudio);
+
+	if (gst_haikuaudio_sink_gate_acquire(&haikuaudio->unblockGate, system_time() + haikuaudio->latency_time,
+			&haikuaudio->statWriteFast, &haikuaudio->statWriteSlow) != B_OK) {
+		/* during the group lead the callback plays silence and takes
+		 * nothing, waiting for it is expected */
+		if (atomic_get64(&haikuaudio->syncStart) == 0 || haikuaudio->syncStarted)
+			atomic_add64(&haikuaudio->statWriteTimeouts, 1);
 		return 0;
+	}
 
 	memcpy(haikuaudio->buffer, data, length);
-	haikuaudio->lastWriteTime = system_time();
-	release_sem(haikuaudio->block_sem);
+	haikuaudio->segmentLength = length;
+	haikuaudio->segmentTime = system_time();
+	haikuaudio->lastWriteTime = haikuaudio->segmentTime;
+	atomic_add64(&haikuaudio->statSegments, 1);
+	gst_haikuaudio_sink_gate_release(&haikuaudio->blockGate, 0);
 
 	return length;
 }
@@ -438,11 +1943,47 @@ mediakit_format_from_gst (GstAudioFormat format)
 	}
 }
 
+static GstAudioFormat
+gst_format_from_mediakit (uint32 format)
+{
+	switch (format) {
+		case media_raw_audio_format::B_AUDIO_CHAR:
+			return GST_AUDIO_FORMAT_S8;
+
+		case media_raw_audio_format::B_AUDIO_UCHAR:
+			return GST_AUDIO_FORMAT_U8;
+
+		case media_raw_audio_format::B_AUDIO_SHORT:
+			return GST_AUDIO_FORMAT_S16LE;
+
+		case media_raw_audio_format::B_AUDIO_INT:
+			return GST_AUDIO_FORMAT_S32LE;
+
+		case media_raw_audio_format::B_AUDIO_FLOAT:
+			return GST_AUDIO_FORMAT_F32LE;
+
+		default:
+			g_assert_not_reached ();
+	}
+}
+
 static gboolean
 gst_haikuaudio_sink_prepare (GstAudioSink * asink, GstAudioRingBufferSpec * spec)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
+	/* on a caps change the player is still running: let it play out the
+	 * segment queued in the old format before the hand-off is reset */
+	if (haikuaudio->playerRunning) {
+		int64 fast = 0, slow = 0;
+		if (gst_haikuaudio_sink_gate_acquire(&haikuaudio->unblockGate,
+				system_time() + 2 * haikuaudio->latency_time, &fast, &slow) == B_OK)
+			gst_haikuaudio_sink_gate_release(&haikuaudio->unblockGate, 0);
+	}
+
+	g_mutex_lock (&haikuaudio->configLock);
+
+	haikuaudio->streamInfo = spec->info;
 	haikuaudio->latency_time = spec->latency_time;
 	haikuaudio->bytesPerFrame = GST_AUDIO_INFO_BPF (&spec->info);
 	spec->segsize = (spec->latency_time * GST_AUDIO_INFO_RATE (&spec->info) / G_USEC_PER_SEC) *
@@ -456,34 +1997,100 @@ gst_haikuaudio_sink_prepare (GstAudioSink * asink, GstAudioRingBufferSpec * spec
 		(uint32)spec->segsize
   	};
 
-	haikuaudio->buffer = (unsigned char*)g_malloc (spec->segsize);
+	gst_haikuaudio_sink_reset_stats(haikuaudio);
+
+	if (haikuaudio->bufferSize < (guint32)spec->segsize) {
+		g_free (haikuaudio->buffer);
+		haikuaudio->buffer = (unsigned char*)g_malloc (spec->segsize);
+		haikuaudio->bufferSize = spec->segsize;
+		atomic_add64(&haikuaudio->statAllocations, 1);
+	}
 	memset (haikuaudio->buffer, 0, spec->segsize);
 
-	if (haikuaudio->is_webapp) {
+	gst_haikuaudio_sink_level_reset(haikuaudio);
+	for (int c = 0; c < GST_HAIKUAUDIOSINK_MAX_CHANNELS; c++)
+		haikuaudio->levelDecay[c] = -G_MAXDOUBLE;
+	haikuaudio->silentSince = 0;
+	haikuaudio->starvedSince = 0;
+
+	if (haikuaudio->playerRunning)
+		gst_haikuaudio_sink_reset_handoff(haikuaudio);
+
+	g_mutex_unlock (&haikuaudio->configLock);
+
+	if (haikuaudio->monitorThread < 0) {
 		haikuaudio->monitorThread = spawn_thread(gst_haikuaudio_sink_monitor_thread,
 			"monitor_thread", B_NORMAL_PRIORITY, (void*)haikuaudio);
 		resume_thread(haikuaudio->monitorThread);
-	} else {
+	}
+
+	if (haikuaudio->is_webapp) {
+		haikuaudio->lastWriteTime = system_time();
+		atomic_set(&haikuaudio->monitorActive, 1);
+		release_sem(haikuaudio->monitorSem);
+	}
+
+	if (!haikuaudio->is_webapp || haikuaudio->playerRunning)
 		gst_haikuaudio_sink_soundplayer_create(haikuaudio);
+
+	/* prepare runs in PAUSED: unless playback resumes, the new player is
+	 * stopped again like after a pause */
+	if (atomic_get(&haikuaudio->streaming) == 0) {
+		atomic_set64(&haikuaudio->stoppedSince, system_time());
+		release_sem(haikuaudio->monitorSem);
 	}
 
+	if (atomic_get(&haikuaudio->idle) != 0)
+		gst_haikuaudio_sink_idle_set(haikuaudio, FALSE);
+
+	gst_haikuaudio_sink_latency_update(haikuaudio, TRUE);
+
 	return TRUE;
 }
 
-static gboolean
-gst_haikuaudio_sink_unprepare (GstAudioSink * asink)
+/* The player is not stopped here: the monitor stops it once streaming
+ * has been off for PLAYER_LINGER, which a caps change never reaches. */
+static void
+gst_haikuaudio_sink_streaming_stopped (GstHaikuAudioSink * sink)
+{
+	atomic_set64(&sink->stoppedSince, system_time());
+	atomic_set(&sink->streaming, 0);
+	release_sem(sink->monitorSem);
+}
+
+static void
+gst_haikuaudio_sink_pause (GstAudioSink * asink)
 {
 	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	if (haikuaudio->is_webapp)
-		kill_thread(haikuaudio->monitorThread);
+	gst_haikuaudio_sink_streaming_stopped(haikuaudio);
+}
 
-	gst_haikuaudio_sink_soundplayer_delete(haikuaudio);
+static void
+gst_haikuaudio_sink_resume (GstAudioSink * asink)
+{
+	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
-	if(haikuaudio->buffer != NULL) {
-		free(haikuaudio->buffer);
-		haikuaudio->buffer = NULL;
-	}
+	atomic_set64(&haikuaudio->stoppedSince, 0);
+	atomic_set(&haikuaudio->streaming, 1);
+}
+
+static void
+gst_haikuaudio_sink_stop (GstAudioSink * asink)
+{
+	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
+
+	gst_haikuaudio_sink_streaming_stopped(haikuaudio);
+}
+
+static gboolean
+gst_haikuaudio_sink_unprepare (GstAudioSink * asink)
+{
+	GstHaikuAudioSink *haikuaudio = GST_HAIKUAUDIOSINK (asink);
 
+	/* the player lingers so a following prepare for new caps does not have
+	 * to restart it; the monitor stops it when no prepare comes, and keeps
+	 * reaping web app players. The buffer, semaphores, recorder and monitor
+	 * thread are kept until finalize. */
 	return TRUE;
 }
@@ -18,6 +18,7 @@
 
 #include <gst/gst.h>
 #include <gst/audio/gstaudiosink.h>
+#include <gst/audio/audio-converter.h>
 //#include <gst/interfaces/mixer.h>
 
 #include <Application.h>
@@ -37,28 +38,176 @@ G_BEGIN_DECLS
 #define GST_IS_HAIKUAUDIOSINK(obj)         (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_HAIKUAUDIOSINK))
 #define GST_IS_HAIKUAUDIOSINK_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_HAIKUAUDIOSINK))
 
+#define GST_HAIKUAUDIOSINK_LATENCY_BUCKETS 24
+#define GST_HAIKUAUDIOSINK_MAX_CHANNELS    2
+
+#define GST_HAIKUAUDIOSINK_RECORDER_MAGIC   'HASR'
+#define GST_HAIKUAUDIOSINK_RECORDER_VERSION 1
+#define GST_HAIKUAUDIOSINK_RECORD_TIMEOUT   0x1
+#define GST_HAIKUAUDIOSINK_RECORD_PAUSED    0x2
+
+/* Layout of the flight recorder area: this header, recordCount records,
+ * then sampleSize bytes of callback output used as a ring. The format is
+ * the player's, which differs from the stream's while it is converted. */
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	float frameRate;
+	uint32 channelCount;
+	uint32 format;
+	uint32 recordCount;
+	uint64 sampleSize;
+	int64 position;
+	int64 records;
+} GstHaikuAudioSinkRecorderHeader;
+
+typedef struct {
+	bigtime_t time;
+	bigtime_t wait;
+	int64 position;
+	uint32 length;
+	uint16 flags;
+	/* segments waiting in the hand-off when the callback ran */
+	uint16 queued;
+} GstHaikuAudioSinkRecord;
+
+/* Counting semaphore that only enters the kernel when a side has to sleep:
+ * count is the number of free units, negative while somebody waits on sem. */
+typedef struct {
+	int32 count;
+	sem_id sem;
+} GstHaikuAudioSinkGate;
+
 typedef struct _GstHaikuAudioSink GstHaikuAudioSink;
+typedef struct _GstHaikuAudioSinkSyncGroup GstHaikuAudioSinkSyncGroup;
 typedef struct _GstHaikuAudioSinkClass GstHaikuAudioSinkClass;
 
 struct _GstHaikuAudioSink {
 	GstAudioSink sink;
 
 	guint8 *buffer;
+	guint32 bufferSize;
+	guint32 segmentLength;
+	bigtime_t segmentTime;
+	guint32 readOffset;
+	gboolean holding;
 
 	media_raw_audio_format mediaKitFormat;
+	media_raw_audio_format playerFormat;
 	guint32 bytesPerFrame;
 	bigtime_t latency_time;
 
-	sem_id block_sem;
-	sem_id unblock_sem;
+	/* held by prepare while it reconfigures; the callback only try-locks
+	 * it and outputs silence meanwhile */
+	GMutex configLock;
+
+	/* set when a running player kept its format across a caps change */
+	GstAudioInfo streamInfo;
+	GstAudioConverter *converter;
+	guint8 *convertBuffer;
+	guint32 convertBufferSize;
+	guint32 playerBytesPerFrame;
+
+	GstHaikuAudioSinkGate blockGate;
+	GstHaikuAudioSinkGate unblockGate;
 
 	thread_id monitorThread;
+	sem_id monitorSem;
+	int32 monitorActive;
+	int32 monitorQuit;
 
+	GRecMutex playerLock;
 	BSoundPlayer *soundPlayer;
+	gboolean playerRunning;
+	bigtime_t playerLatency;
+
+	/* set while the ring buffer is started: by write(), which only runs
+	 * then, and by resume; cleared by pause and stop. The player may keep
+	 * running while it is paused, and silence is expected then */
+	int32 streaming;
+	/* when streaming last stopped; the monitor stops the player once it
+	 * has been idle for PLAYER_LINGER */
+	int64 stoppedSince;
+
+	/* added to the base class answer to LATENCY queries */
+	int64 reportedLatency;
+	bigtime_t latencyCheckTime;
+	gchar *playerDevice;
 	BString *nodeName;
+	gchar *device;
 	GstCaps caps;
 
 	bigtime_t lastWriteTime;
+	bigtime_t lastCallbackTime;
+
+	/* idle mode: the player is told it has no data, so the mixer skips it */
+	int64 idleTimeout;
+	int32 idle;
+	/* set by the callback when starved, applied by the monitor */
+	int32 idleRequest;
+	bigtime_t silentSince;
+	bigtime_t starvedSince;
+	bigtime_t idleDeadline;
+
+	/* sinks sharing a sync group start playout at the same time; the
+	 * group is joined while the player runs, syncStart is set by write() */
+	gchar *syncGroupName;
+	GstHaikuAudioSinkSyncGroup *syncGroup;
+	int64 syncStart;
+	gboolean syncStarted;
+	int64 statSyncOffset;
+
+	/* playback statistics, updated lock-free by write() and the callback */
+	int64 statSegments;
+	int64 statCallbacks;
+	int64 statUnderruns;
+	int64 statWriteTimeouts;
+	int64 statWriteFast;
+	int64 statWriteSlow;
+	int64 statCallbackFast;
+	int64 statCallbackSlow;
+	int64 statAllocations;
+	int64 statPlayers;
+	int64 statIdleEntries;
+	int64 statFrames;
+	int64 statPlayoutTime;
+	int64 statStreamTime;
+	/* CPU time of player threads that went away, plus the current one's
+	 * time since callbackCpuBase */
+	int64 statCallbackCpu;
+	thread_id callbackThread;
+	int64 callbackCpuBase;
+	int64 statJitterSum;
+	int64 statJitterMax;
+	int64 statLatencyHist[GST_HAIKUAUDIOSINK_LATENCY_BUCKETS];
+
+	/* metering of what reaches the player, in the player's format,
+	 * accumulated in the callback and published for write() through a
+	 * sequence lock */
+	int64 levelInterval;
+	int64 levelFrames;
+	float levelPeak[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	double levelSum[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	int32 levelSeq;
+	int32 levelPosted;
+	float levelPeakOut[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	float levelRmsOut[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+	int64 levelDurationOut;
+	uint32 levelChannelsOut;
+	bigtime_t levelEndOut;
+	/* decaying peak in dB, kept by write() */
+	gdouble levelDecay[GST_HAIKUAUDIOSINK_MAX_CHANNELS];
+
+	/* flight recorder, appended lock-free by the callback */
+	guint recorderSeconds;
+	gchar *recorderLocation;
+	GMutex recorderLock;
+	area_id recorderArea;
+	GstHaikuAudioSinkRecorderHeader *recorderHeader;
+	GstHaikuAudioSinkRecord *recorderRecords;
+	guint8 *recorderSamples;
+	int32 recorderTimeouts;
+	int32 recorderDumpPending;
 
 	double volume;
 	gboolean mute;
@@ -68,6 +217,8 @@ struct _GstHaikuAudioSink {
 
 struct _GstHaikuAudioSinkClass {
 	GstAudioSinkClass parent_class;
+
+	gboolean (*dump_flight_recorder) (GstHaikuAudioSink *sink);
 };
 
 GType gst_haikuaudio_sink_get_type(void);